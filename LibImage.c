@@ -1,5 +1,29 @@
+/*
+ * clock_gettime and CLOCK_MONOTONIC are POSIX, a strict -std=c99/c11 build only declares
+ * them when asked to. set here rather than in libimage.h, so programs including the header
+ * keep their own feature set, and before it because it has to precede the first system header
+ */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "libimage.h"
 
+/*
+ * lookup tables of the gamma-correct averaging, filled once by initLinearLuts
+ */
+uint16_t srgbToLinearLut[256];
+byte linearToSrgbLut[LINEAR_LUT_L];
+Once linearLutsOnce = ONCE_INIT;
+
+/*
+ * numbering of the caches created by this process, it keeps the spill files of caches
+ * sharing a disk directory apart (together with the process id)
+ */
+unsigned long nextCacheInstance;
+Mutex cacheInstanceLock;
+Once cacheInstanceOnce = ONCE_INIT;
+
 void readFromBuffer(png_structp png_ptr, png_bytep dataBuffer, png_size_t bytesToRead)
 {
     png_voidp io_ptr = png_get_io_ptr(png_ptr);
@@ -10,8 +34,13 @@ void readFromBuffer(png_structp png_ptr, png_bytep dataBuffer, png_size_t bytesT
     }
 
     Buffer* inBuffer = (Buffer*)io_ptr;
+    if (bytesToRead > inBuffer->size)
+    {
+        png_error(png_ptr, "read past the end of the input buffer");
+    }
     memcpy(dataBuffer, inBuffer->buf, bytesToRead);
     inBuffer->buf += bytesToRead;
+    inBuffer->size -= bytesToRead;
 }
 
 void writeToBuffer(png_structp png_ptr, png_bytep dataBuffer, png_size_t bytesToRead)
@@ -30,18 +59,18 @@ void writeToBuffer(png_structp png_ptr, png_bytep dataBuffer, png_size_t bytesTo
         outBuffer->buf = (byte*)malloc(sizeof(byte) * bytesToRead);
         if (!outBuffer->buf)
         {
-            printf("allocation failed for out-buffer\n");
-            return;
+            png_error(png_ptr, "allocation failed for out-buffer");
         }
     }
     else
     {
+        /*
+         * the old block stays owned by outBuffer, the save handler's setjmp releases it
+         */
         byte* newBuf = (byte*)realloc(outBuffer->buf, sizeof(byte) * (outBuffer->size + bytesToRead));
         if (!newBuf)
         {
-            printf("realloc failed for out-buffer\n");
-            free(outBuffer->buf);
-            return;
+            png_error(png_ptr, "realloc failed for out-buffer");
         }
         outBuffer->buf = newBuf;
     }
@@ -53,6 +82,8 @@ void writeToBuffer(png_structp png_ptr, png_bytep dataBuffer, png_size_t bytesTo
 * return suffices here because once you return prematurely from read/write procedures libpng will
 * detect the missing bytes in a short while (be it a null ptr, missing magic numbers or bad crc)
 * once an error is raised, the next block of execution will be the setjmp that's in open/save
+* running out of input or out-buffer memory raises the error directly, continuing would touch
+* memory past the end of the buffers
 */
 
 bool isFormatMatch(const byte* inBuffer, const byte* format, int formatLen)
@@ -87,18 +118,18 @@ bool formatCompIgnoreCase(const char* s1, const char* s2)
     return true;
 }
 
-enum format isFormatSupported(const byte* inBuffer)
+enum format isFormatSupported(const byte* inBuffer, size_t inSize)
 {
     if (!inBuffer)
     {
         return NoneFormat;
     }
 
-    if (isFormatMatch(inBuffer, jpeg, JPEG_L) || isFormatMatch(inBuffer, jpeg2, JPEG_L))
+    if (inSize >= JPEG_L && (isFormatMatch(inBuffer, jpeg, JPEG_L) || isFormatMatch(inBuffer, jpeg2, JPEG_L)))
     {
         return Jpeg;
     }
-    if (isFormatMatch(inBuffer, png, PNG_L))
+    if (inSize >= PNG_L && isFormatMatch(inBuffer, png, PNG_L))
     {
         return Png;
     }
@@ -126,11 +157,30 @@ enum colorType pngColorTypeDictionary(byte colorType)
 
 bool openImage(byte* inBuffer, Image** image)
 {
-    enum format imageFormat = isFormatSupported(inBuffer);
+    return openImageJob(inBuffer, UNBOUNDED_SIZE, NULL, image, NULL);
+}
+
+bool openImageSized(byte* inBuffer, size_t inSize, Image** image)
+{
+    return openImageJob(inBuffer, inSize, NULL, image, NULL);
+}
+
+bool openImageWithOptions(byte* inBuffer, size_t inSize, const DecodeOptions* options, Image** image)
+{
+    return openImageJob(inBuffer, inSize, options, image, NULL);
+}
+
+bool openImageJob(byte* inBuffer, size_t inSize, const DecodeOptions* options, Image** image, ImageJob* job)
+{
+    if (!checkDecodeOptions(options))
+    {
+        return false;
+    }
+    enum format imageFormat = isFormatSupported(inBuffer, inSize);
     switch (imageFormat)
     {
     case Png:
-        return handleOpenPng(inBuffer, image);
+        return handleOpenPng(inBuffer, inSize, options, image, job);
     case Jpeg:
         /*
          * return handleOpenJpeg(buf, image);
@@ -141,7 +191,7 @@ bool openImage(byte* inBuffer, Image** image)
     }
 }
 
-bool handleOpenPng(byte* inBuffer, Image** image)
+bool handleOpenPng(byte* inBuffer, size_t inSize, const DecodeOptions* options, Image** image, ImageJob* job)
 {
     png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png_ptr)
@@ -165,7 +215,7 @@ bool handleOpenPng(byte* inBuffer, Image** image)
         return false;
     }
 
-    Buffer pngReadBuffer = { inBuffer, 0 };
+    Buffer pngReadBuffer = { inBuffer, inSize };
     png_set_read_fn(png_ptr, &pngReadBuffer, readFromBuffer);
     png_set_sig_bytes(png_ptr, 0);
 
@@ -188,7 +238,31 @@ bool handleOpenPng(byte* inBuffer, Image** image)
         return false;
     }
 
+    /*
+     * with a target layout libpng only unpacks sub-byte samples, everything else is
+     * done by the layout kernels while the rows are read. the one exception is the tRNS
+     * color key of 16-bit images, it has to be matched before the samples are reduced
+     */
+    bool convert = options && options->layout != LayoutNative;
+    if (convert && bitDepth < 8)
+    {
+        if (colorType == PNG_COLOR_TYPE_GRAY)
+        {
+            png_set_expand_gray_1_2_4_to_8(png_ptr);
+        }
+        else
+        {
+            png_set_packing(png_ptr);
+        }
+    }
+    if (convert && bitDepth == 16 && png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+    {
+        png_set_tRNS_to_alpha(png_ptr);
+    }
+
+    int passes = png_set_interlace_handling(png_ptr);
     png_read_update_info(png_ptr, info_ptr);
+    size_t rowBytes = convert ? width * layoutChannels(options->layout) : png_get_rowbytes(png_ptr, info_ptr);
 
     rowPtrs = (byte**)malloc(sizeof(byte*) * height);
     if (!rowPtrs)
@@ -200,7 +274,7 @@ bool handleOpenPng(byte* inBuffer, Image** image)
     size_t i;
     for (i = 0; i < height; ++i)
     {
-        rowPtrs[i] = (byte*)malloc(png_get_rowbytes(png_ptr, info_ptr));
+        rowPtrs[i] = (byte*)malloc(rowBytes);
         if (!rowPtrs[i])
         {
             printf("allocation for binary image data failed\n");
@@ -218,7 +292,38 @@ bool handleOpenPng(byte* inBuffer, Image** image)
         return false;
     }
 
-    png_read_image(png_ptr, rowPtrs);
+    if (convert)
+    {
+        if (!readPngRowsConverted(png_ptr, info_ptr, options, bitDepth, passes, rowPtrs, job))
+        {
+            freeRows(rowPtrs, height);
+            png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+            return false;
+        }
+        bitDepth = 8;
+        colorType = layoutColorType(options->layout);
+        colorTypeEnum = pngColorTypeDictionary(colorType);
+    }
+
+    /*
+     * rows are read in bands (once per interlace pass) so a cancelled job stops early
+     */
+    int pass;
+    for (pass = 0; pass < passes && !convert; ++pass)
+    {
+        for (i = 0; i < height; i += JOB_BAND_ROWS)
+        {
+            if (isJobCancelled(job))
+            {
+                printf("reading the image was cancelled\n");
+                freeRows(rowPtrs, height);
+                png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+                return false;
+            }
+            size_t band = height - i < JOB_BAND_ROWS ? height - i : JOB_BAND_ROWS;
+            png_read_rows(png_ptr, rowPtrs + i, NULL, band);
+        }
+    }
 
     png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
 
@@ -242,266 +347,3016 @@ bool handleOpenPng(byte* inBuffer, Image** image)
     return true;
 }
 
-void freeRows(byte** rowPtrs, size_t height)
+ProgressiveDecoder* createProgressiveDecoder(size_t previewRows, PreviewCallback callback, void* userData)
 {
-    size_t i;
-    for (i = 0; i < height; ++i)
+    ProgressiveDecoder* decoder = (ProgressiveDecoder*)calloc(1, sizeof(ProgressiveDecoder));
+    if (!decoder)
     {
-        free(rowPtrs[i]);
+        printf("allocation for progressive decoder failed\n");
+        return NULL;
     }
-    free(rowPtrs);
+
+    decoder->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!decoder->png_ptr)
+    {
+        printf("creation of png_structp failed\n");
+        free(decoder);
+        return NULL;
+    }
+    decoder->info_ptr = png_create_info_struct(decoder->png_ptr);
+    if (!decoder->info_ptr)
+    {
+        printf("creation of png_infop failed\n");
+        png_destroy_read_struct(&decoder->png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+        free(decoder);
+        return NULL;
+    }
+
+    decoder->previewRows = previewRows;
+    decoder->callback = callback;
+    decoder->userData = userData;
+    decoder->lastPass = -1;
+    png_set_progressive_read_fn(decoder->png_ptr, decoder, progressiveInfo, progressiveRow, progressiveEnd);
+    return decoder;
 }
 
-bool saveImage(Image* image, const char* format, byte** outBuffer)
+void freeProgressiveDecoder(ProgressiveDecoder* decoder)
 {
-    if (!image || !format)
+    if (!decoder)
     {
-        return false;
+        return;
+    }
+    png_destroy_read_struct(&decoder->png_ptr, &decoder->info_ptr, (png_infopp)NULL);
+    if (decoder->rowPtrs)
+    {
+        freeRows(decoder->rowPtrs, decoder->allocatedRows);
+    }
+    if (decoder->previewPtrs)
+    {
+        freeRows(decoder->previewPtrs, decoder->allocatedRows);
     }
+    free(decoder);
+}
 
-    if (formatCompIgnoreCase(format, PNG))
+bool feedProgressiveDecoder(ProgressiveDecoder* decoder, byte* data, size_t size)
+{
+    if (!decoder || decoder->failed || decoder->stopped)
     {
-        return handleSavePng(image, outBuffer);
+        return false;
     }
-    if (formatCompIgnoreCase(format, JPEG))
+    if (decoder->finished)
     {
-        /*
-         * return handleSaveJpeg(image, retBuffer);
-         * support for the format can be added easily in the future
-         */
+        return true;
     }
 
-    return false;
+    if (setjmp(png_jmpbuf(decoder->png_ptr)))
+    {
+        if (!decoder->stopped)
+        {
+            printf("failed decoding the image progressively\n");
+            decoder->failed = true;
+        }
+        return false;
+    }
+    png_process_data(decoder->png_ptr, decoder->info_ptr, data, size);
+
+    return !decoder->stopped;
 }
 
-bool handleSavePng(Image* image, byte** outBuffer)
+bool finishProgressiveDecoder(ProgressiveDecoder* decoder, Image** image)
 {
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr)
+    if (!decoder || decoder->failed || !decoder->rowPtrs || !(decoder->finished || decoder->stopped))
     {
-        printf("creation of png_structp failed\n");
         return false;
     }
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
+
+    Image* img = (Image*)malloc(sizeof(Image));
+    if (!img)
     {
-        printf("creation of png_infop failed\n");
-        png_destroy_write_struct(&png_ptr, NULL);
+        printf("image allocation failed\n");
         return false;
     }
-    if (setjmp(png_jmpbuf(png_ptr)))
+    *img = decoder->image;
+
+    /*
+     * a complete decode hands over the decoded rows, a stopped one hands over what the
+     * last preview showed (the filled rows of an interlaced image, or the rows read so far)
+     */
+    if (decoder->finished || !decoder->previewPtrs)
     {
-        printf("failed setting header info\n");
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        return false;
+        size_t height = decoder->finished ? decoder->allocatedRows : decoder->rowsDone;
+        size_t i;
+        for (i = height; i < decoder->allocatedRows; ++i)
+        {
+            free(decoder->rowPtrs[i]);
+        }
+        img->rowPtrs = decoder->rowPtrs;
+        img->height = height;
+        decoder->rowPtrs = NULL;
+    }
+    else
+    {
+        img->rowPtrs = decoder->previewPtrs;
+        img->height = decoder->allocatedRows;
+        decoder->previewPtrs = NULL;
     }
-    png_set_IHDR(png_ptr, info_ptr, image->width, image->height, image->bitDepth, image->colorTypeVal,
-        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
-    png_set_compression_level(png_ptr, 1);
-    png_set_filter(png_ptr, 0, PNG_ALL_FILTERS);
-    png_set_rows(png_ptr, info_ptr, image->rowPtrs);
+    *image = img;
+    return true;
+}
 
-    byte* emptyBuffer = NULL;
-    Buffer pngWriteBuffer = { emptyBuffer, 0 };
-    png_set_write_fn(png_ptr, &pngWriteBuffer, writeToBuffer, NULL);
+void progressiveInfo(png_structp png_ptr, png_infop info_ptr)
+{
+    ProgressiveDecoder* decoder = (ProgressiveDecoder*)png_get_progressive_ptr(png_ptr);
 
-    if (setjmp(png_jmpbuf(png_ptr)))
+    byte colorType = png_get_color_type(png_ptr, info_ptr);
+    if (pngColorTypeDictionary(colorType) == NoneType)
     {
-        printf("failed writing image data\n");
-        if (!pngWriteBuffer.buf)
+        png_error(png_ptr, "data integrity error, color-type is unknown");
+    }
+
+    /*
+     * sub-byte samples are unpacked so a pixel is always a whole number of bytes,
+     * which is what the block filling of the interlaced previews works with
+     */
+    if (png_get_bit_depth(png_ptr, info_ptr) < 8)
+    {
+        if (colorType == PNG_COLOR_TYPE_GRAY)
         {
-            free(outBuffer);
+            png_set_expand_gray_1_2_4_to_8(png_ptr);
+        }
+        else
+        {
+            png_set_packing(png_ptr);
         }
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        return false;
     }
+    decoder->passes = png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
 
-    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+    size_t height = png_get_image_height(png_ptr, info_ptr);
+    size_t rowBytes = png_get_rowbytes(png_ptr, info_ptr);
+    decoder->rowPtrs = (byte**)calloc(height, sizeof(byte*));
+    if (decoder->passes > 1)
+    {
+        decoder->previewPtrs = (byte**)calloc(height, sizeof(byte*));
+    }
+    if (!decoder->rowPtrs || (decoder->passes > 1 && !decoder->previewPtrs))
+    {
+        png_error(png_ptr, "allocation for binary image data failed");
+    }
+    decoder->allocatedRows = height;
 
-    freeRows(image->rowPtrs, image->height);
-    free(image);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
+    size_t i;
+    for (i = 0; i < height; ++i)
+    {
+        decoder->rowPtrs[i] = (byte*)calloc(rowBytes, sizeof(byte));
+        if (decoder->previewPtrs)
+        {
+            decoder->previewPtrs[i] = (byte*)malloc(sizeof(byte) * rowBytes);
+        }
+        if (!decoder->rowPtrs[i] || (decoder->previewPtrs && !decoder->previewPtrs[i]))
+        {
+            png_error(png_ptr, "allocation for binary image data failed");
+        }
+    }
 
-    *outBuffer = pngWriteBuffer.buf;
-    return true;
+    decoder->image.width = png_get_image_width(png_ptr, info_ptr);
+    decoder->image.height = 0;
+    decoder->image.bitDepth = png_get_bit_depth(png_ptr, info_ptr);
+    decoder->image.colorTypeVal = png_get_color_type(png_ptr, info_ptr);
+    decoder->image.colorTypeEnum = pngColorTypeDictionary(decoder->image.colorTypeVal);
+    decoder->image.rowPtrs = decoder->rowPtrs;
+    decoder->bytesPerPixel = decoder->image.width ? rowBytes / decoder->image.width : 0;
 }
 
-bool averageImage(int avgDim, Image* image)
+void progressiveRow(png_structp png_ptr, png_bytep newRow, png_uint_32 rowNum, int pass)
 {
-    if (image->colorTypeEnum == RGBA && image->bitDepth == 8)
+    ProgressiveDecoder* decoder = (ProgressiveDecoder*)png_get_progressive_ptr(png_ptr);
+
+    if (decoder->passes > 1 && pass != decoder->lastPass)
     {
-        return handleEightBitRgbaAveraging(image, avgDim);
+        /*
+         * a new pass started, so every pass up to the last one is complete
+         */
+        if (decoder->lastPass >= 0)
+        {
+            emitAdam7Preview(decoder, decoder->lastPass);
+        }
+        decoder->lastPass = pass;
     }
-    return false;
-}
 
-bool handleEightBitRgbaAveraging(Image* image, int avgDim)
-{
-    size_t newHeight = image->height / avgDim;
-    size_t newWidth = image->width / avgDim;
-    int travDistance = avgDim - 1;
-    byte** rows = image->rowPtrs;
+    if (newRow)
+    {
+        png_progressive_combine_row(png_ptr, decoder->rowPtrs[rowNum], newRow);
+    }
 
-    byte** newRows = createAvgImage(rows, newHeight, newWidth, avgDim);
-    if (!newRows)
+    if (decoder->passes == 1)
     {
-        return false;
+        decoder->rowsDone = rowNum + 1;
+        if (decoder->previewRows && decoder->rowsDone % decoder->previewRows == 0 &&
+            decoder->rowsDone < decoder->allocatedRows)
+        {
+            emitProgressivePreview(decoder, decoder->rowsDone, 0);
+        }
     }
+}
 
-    image->height = newHeight;
-    image->width = newWidth;
-    image->rowPtrs = newRows;
+void progressiveEnd(png_structp png_ptr, png_infop info_ptr)
+{
+    ProgressiveDecoder* decoder = (ProgressiveDecoder*)png_get_progressive_ptr(png_ptr);
+    decoder->rowsDone = decoder->allocatedRows;
+    decoder->finished = true;
+}
 
-    return true;
+void emitAdam7Preview(ProgressiveDecoder* decoder, int pass)
+{
+    fillAdam7Preview(decoder->rowPtrs, decoder->previewPtrs, decoder->image.width,
+        decoder->allocatedRows, decoder->bytesPerPixel, pass);
+    emitProgressivePreview(decoder, decoder->allocatedRows, pass);
 }
 
-byte** createAvgImage(byte** rows, size_t newHeight, size_t newWidth, int numOfImgs)
+void emitProgressivePreview(ProgressiveDecoder* decoder, size_t height, int pass)
 {
-    byte** newRows = (byte**)malloc(sizeof(byte*) * newHeight);
-    if (!newRows)
+    decoder->image.rowPtrs = decoder->previewPtrs ? decoder->previewPtrs : decoder->rowPtrs;
+    decoder->image.height = height;
+    if (decoder->callback && !decoder->callback(&decoder->image, pass, decoder->userData))
     {
-        printf("failed to allocate memory for averaged image");
-        return NULL;
+        /*
+         * the caller has seen enough, jump straight back out of png_process_data
+         * (the reader is never resumed, so its half-processed state doesn't matter)
+         */
+        decoder->stopped = true;
+        png_longjmp(decoder->png_ptr, 1);
     }
+}
 
+void fillAdam7Preview(byte** rows, byte** previewRows, size_t width, size_t height, size_t bytesPerPixel, int pass)
+{
+    /*
+     * after each pass the known pixels form a grid, every pixel of the preview takes the
+     * value of the known pixel at the top-left corner of its grid cell
+     */
+    static const int cellWidth[7] = { 8, 4, 4, 2, 2, 1, 1 };
+    static const int cellHeight[7] = { 8, 8, 4, 4, 2, 2, 1 };
+    size_t stepX = cellWidth[pass], stepY = cellHeight[pass];
     size_t y, x;
-    for (y = 0; y < newHeight; ++y)
+    for (y = 0; y < height; ++y)
     {
-        byte* row = rows[y];
-        byte* newRow = (byte*)malloc(sizeof(byte) * newWidth * 4);
-        if (!newRow)
-        {
-            printf("failed to allocate memory for averaged image");
-            freeRows(newRows, y);
-            return NULL;
-        }
-        newRows[y] = newRow;
-        for (x = 0; x < newWidth; ++x)
+        const byte* row = rows[y - y % stepY];
+        byte* previewRow = previewRows[y];
+        for (x = 0; x < width; x += stepX)
         {
-            size_t pos = x * 4;
-            int avgs[4] = { 0 };
-            calcAverage(rows, numOfImgs, pos * numOfImgs, y * numOfImgs, avgs);
-            newRow[pos++] = avgs[0];
-            newRow[pos++] = avgs[1];
-            newRow[pos++] = avgs[2];
-            newRow[pos] = avgs[3];
+            size_t cell = width - x < stepX ? width - x : stepX;
+            size_t k;
+            for (k = 0; k < cell; ++k)
+            {
+                memcpy(previewRow + (x + k) * bytesPerPixel, row + x * bytesPerPixel, bytesPerPixel);
+            }
         }
     }
-    return newRows;
 }
 
-void calcAverage(byte** rows, int avgDim, size_t start_x, size_t start_y, int* avgs)
+int layoutChannels(enum pixelLayout layout)
 {
-    int y = 0, x = 0;
-    int sum[4] = { 0 };
-    for (y = 0; y < avgDim; ++y)
+    switch (layout)
     {
-        byte* row = rows[y + start_y];
-        for (x = 0; x < avgDim * 4; x += 4)
-        {
-            size_t pos = x + start_x;
-            sum[0] += row[pos++];
-            sum[1] += row[pos++];
-            sum[2] += row[pos++];
-            sum[3] += row[pos];
-        }
+    case LayoutRgba8:
+        return 4;
+    case LayoutRgb8:
+        return 3;
+    case LayoutGray8:
+        return 1;
+    default:
+        return 0;
     }
-    int i, size = avgDim * avgDim;
-    for (i = 0; i < 4; ++i)
+}
+
+bool checkDecodeOptions(const DecodeOptions* options)
+{
+    if (!options)
     {
-        avgs[i] = sum[i] / size;
+        return true;
+    }
+    if (options->layout != LayoutNative && !layoutChannels(options->layout))
+    {
+        printf("unknown decode layout %d\n", (int)options->layout);
+        return false;
+    }
+    if (options->premultiplied && options->layout != LayoutRgba8)
+    {
+        printf("premultiplied alpha requires the RGBA8 layout\n");
+        return false;
     }
+    return true;
 }
 
-bool paveImage(int numOfImgs, Image* image, Image*** imageChunks)
+byte layoutColorType(enum pixelLayout layout)
 {
-    if (image->colorTypeEnum == RGBA && image->bitDepth == 8)
+    switch (layout)
     {
-        return handleEightBitRgbaPaving(image, numOfImgs, imageChunks);
+    case LayoutRgb8:
+        return PNG_COLOR_TYPE_RGB;
+    case LayoutGray8:
+        return PNG_COLOR_TYPE_GRAY;
+    default:
+        return PNG_COLOR_TYPE_RGB_ALPHA;
     }
-    return false;
 }
 
-bool handleEightBitRgbaPaving(Image* image, int numOfImgs, Image*** imageChunks)
+bool readPngRowsConverted(png_structp png_ptr, png_infop info_ptr, const DecodeOptions* options,
+    byte fileBitDepth, int passes, byte** rowPtrs, ImageJob* job)
 {
-    size_t newHeight = image->height / numOfImgs;
-    size_t newWidth = image->width / numOfImgs;
-    byte** rows = image->rowPtrs;
-    int travDistance = numOfImgs - 1;
-    int i, size = numOfImgs * numOfImgs;
-    byte*** newRowsList = (byte***)malloc(sizeof(byte**) * size);
-    if (!newRowsList)
+    size_t width = png_get_image_width(png_ptr, info_ptr);
+    size_t height = png_get_image_height(png_ptr, info_ptr);
+    size_t nativeRowBytes = png_get_rowbytes(png_ptr, info_ptr);
+    bool isSixteenBit = png_get_bit_depth(png_ptr, info_ptr) == 16;
+    bool isPalette = png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_PALETTE;
+    int channels = png_get_channels(png_ptr, info_ptr);
+    size_t rowStride = isSixteenBit ? nativeRowBytes / 2 : nativeRowBytes;
+
+    byte paletteLut[256 * 4];
+    if (isPalette)
     {
-        printf("allocation for chunked image list failed\n");
+        buildPaletteLut(png_ptr, info_ptr, paletteLut);
+    }
+    byte colorKey[3];
+    bool hasColorKey = !isPalette && buildColorKey(png_ptr, info_ptr, fileBitDepth, colorKey);
+
+    /*
+     * non-interlaced images are decoded one band at a time in to a contiguous scratch,
+     * interlaced ones need every pass before a row is complete so the whole image is
+     */
+    size_t scratchRows = passes > 1 || height < JOB_BAND_ROWS ? height : JOB_BAND_ROWS;
+    byte* scratch = (byte*)malloc(sizeof(byte) * nativeRowBytes * scratchRows);
+    byte** scratchPtrs = (byte**)malloc(sizeof(byte*) * scratchRows);
+    byte* rgbaRow = (byte*)malloc(sizeof(byte) * width * 4);
+    if (!scratch || !scratchPtrs || !rgbaRow)
+    {
+        printf("allocation for layout conversion failed\n");
+        free(scratch);
+        free(scratchPtrs);
+        free(rgbaRow);
         return false;
     }
+    size_t y, i;
+    for (i = 0; i < scratchRows; ++i)
+    {
+        scratchPtrs[i] = scratch + i * nativeRowBytes;
+    }
 
-    int outerX, outerY;
-    size_t y, x;
-    for (outerY = 0; outerY < numOfImgs; ++outerY)
+    /*
+     * the scratch buffers need a handler of their own, the caller's jump buffer is saved
+     * and put back before returning so libpng never jumps in to this (finished) frame
+     */
+    jmp_buf callerJmpBuf;
+    memcpy(callerJmpBuf, png_jmpbuf(png_ptr), sizeof(jmp_buf));
+    if (setjmp(png_jmpbuf(png_ptr)))
     {
-        for (outerX = 0; outerX < numOfImgs; ++outerX)
+        memcpy(png_jmpbuf(png_ptr), callerJmpBuf, sizeof(jmp_buf));
+        printf("failed reading the image\n");
+        free(scratch);
+        free(scratchPtrs);
+        free(rgbaRow);
+        return false;
+    }
+
+    bool cancelled = false;
+    int pass;
+    for (pass = 0; pass < passes && passes > 1 && !cancelled; ++pass)
+    {
+        for (y = 0; y < height && !cancelled; y += JOB_BAND_ROWS)
         {
-            int chunkOffest = outerY * numOfImgs + outerX;
+            cancelled = isJobCancelled(job);
+            if (!cancelled)
+            {
+                size_t band = height - y < JOB_BAND_ROWS ? height - y : JOB_BAND_ROWS;
+                png_read_rows(png_ptr, scratchPtrs + y, NULL, band);
+            }
+        }
+    }
+
+    for (y = 0; y < height && !cancelled; y += JOB_BAND_ROWS)
+    {
+        cancelled = isJobCancelled(job);
+        if (cancelled)
+        {
+            break;
+        }
+        size_t band = height - y < JOB_BAND_ROWS ? height - y : JOB_BAND_ROWS;
+        byte* bandStart = passes > 1 ? scratchPtrs[y] : scratch;
+        if (passes == 1)
+        {
+            png_read_rows(png_ptr, scratchPtrs, NULL, band);
+        }
+
+        /*
+         * the band is contiguous, so the bit-depth reduction runs over all of its rows at once
+         * (in place, the 8-bit rows end up packed at rowStride)
+         */
+        if (isSixteenBit)
+        {
+            sixteenToEightBit(bandStart, bandStart, nativeRowBytes / 2 * band);
+        }
+        for (i = 0; i < band; ++i)
+        {
+            convertRowLayout(bandStart + i * rowStride, channels, isPalette ? paletteLut : NULL,
+                hasColorKey ? colorKey : NULL, options, rgbaRow, rowPtrs[y + i], width);
+        }
+    }
+
+    memcpy(png_jmpbuf(png_ptr), callerJmpBuf, sizeof(jmp_buf));
+    free(scratch);
+    free(scratchPtrs);
+    free(rgbaRow);
+    if (cancelled)
+    {
+        printf("reading the image was cancelled\n");
+    }
+    return !cancelled;
+}
+
+void buildPaletteLut(png_structp png_ptr, png_infop info_ptr, byte* lut)
+{
+    png_colorp palette = NULL;
+    png_bytep trans = NULL;
+    int numOfColors = 0, numOfTrans = 0, i;
+    png_get_PLTE(png_ptr, info_ptr, &palette, &numOfColors);
+    if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+    {
+        png_get_tRNS(png_ptr, info_ptr, &trans, &numOfTrans, NULL);
+    }
+
+    for (i = 0; i < 256; ++i)
+    {
+        byte* entry = lut + i * 4;
+        if (i < numOfColors)
+        {
+            entry[0] = palette[i].red;
+            entry[1] = palette[i].green;
+            entry[2] = palette[i].blue;
+        }
+        else
+        {
+            entry[0] = entry[1] = entry[2] = 0;
+        }
+        entry[3] = i < numOfTrans ? trans[i] : 255;
+    }
+}
+
+/*
+ * the tRNS color key of an 8-bit (or expanded sub-byte) gray/RGB image, scaled the way
+ * png_set_expand_gray_1_2_4_to_8 scales the samples. ret val is false if there is none
+ * (16-bit keys are left to png_set_tRNS_to_alpha, their samples gain an alpha channel)
+ */
+bool buildColorKey(png_structp png_ptr, png_infop info_ptr, byte fileBitDepth, byte* key)
+{
+    png_color_16p keyColor = NULL;
+    int channels = png_get_channels(png_ptr, info_ptr);
+    if (fileBitDepth == 16 || (channels != 1 && channels != 3) ||
+        !png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS) ||
+        !png_get_tRNS(png_ptr, info_ptr, NULL, NULL, &keyColor) || !keyColor)
+    {
+        return false;
+    }
+    if (channels == 1)
+    {
+        int scale = 255 / ((1 << fileBitDepth) - 1);
+        key[0] = (byte)(keyColor->gray * scale);
+    }
+    else
+    {
+        key[0] = (byte)keyColor->red;
+        key[1] = (byte)keyColor->green;
+        key[2] = (byte)keyColor->blue;
+    }
+    return true;
+}
+
+void convertRowLayout(const byte* src, int channels, const byte* paletteLut, const byte* colorKey,
+    const DecodeOptions* options, byte* rgbaRow, byte* dst, size_t width)
+{
+    int dstChannels = layoutChannels(options->layout);
+    if (!paletteLut && !colorKey && channels == dstChannels && !options->premultiplied)
+    {
+        memcpy(dst, src, width * channels);
+        return;
+    }
+
+    /*
+     * every source is expanded to RGBA first (straight in to the output row when RGBA is the
+     * target) and then reduced to the target layout
+     */
+    byte* rgba = options->layout == LayoutRgba8 ? dst : rgbaRow;
+    if (paletteLut)
+    {
+        paletteToRgba(src, paletteLut, rgba, width);
+    }
+    else if (colorKey && channels == 1)
+    {
+        grayKeyToRgba(src, colorKey[0], rgba, width);
+    }
+    else if (colorKey && channels == 3)
+    {
+        rgbKeyToRgba(src, colorKey, rgba, width);
+    }
+    else if (channels == 1)
+    {
+        grayToRgba(src, rgba, width);
+    }
+    else if (channels == 2)
+    {
+        grayAlphaToRgba(src, rgba, width);
+    }
+    else if (channels == 3)
+    {
+        rgbToRgba(src, rgba, width);
+    }
+    else if (rgba == dst)
+    {
+        memcpy(rgba, src, width * 4);
+    }
+    else
+    {
+        rgba = (byte*)src;
+    }
+
+    if (options->premultiplied)
+    {
+        premultiplyRgba(rgba, width);
+    }
+
+    if (options->layout == LayoutRgb8)
+    {
+        rgbaToRgb(rgba, dst, width);
+    }
+    else if (options->layout == LayoutGray8)
+    {
+        rgbaToGray(rgba, dst, width);
+    }
+}
+
+/*
+ * the layout kernels, the scalar loops are kept free of branches and aliasing so the
+ * compiler can vectorize them, the SSE2/SSSE3 paths cover the ones it can't do well
+ */
+void sixteenToEightBit(const byte* src, byte* dst, size_t samples)
+{
+    size_t i = 0;
+#ifdef LIBIMAGE_SSE2
+    /*
+     * png samples are big-endian, so the high byte of each sample is the low byte of its lane
+     */
+    const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+    for (; i + 16 <= samples; i += 16)
+    {
+        __m128i first = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i * 2)), lowBytes);
+        __m128i second = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i * 2 + 16)), lowBytes);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(first, second));
+    }
+#endif
+    for (; i < samples; ++i)
+    {
+        dst[i] = src[i * 2];
+    }
+}
+
+void paletteToRgba(const byte* src, const byte* lut, byte* dst, size_t width)
+{
+    size_t x;
+    for (x = 0; x < width; ++x)
+    {
+        memcpy(dst + x * 4, lut + src[x] * 4, 4);
+    }
+}
+
+void grayToRgba(const byte* src, byte* dst, size_t width)
+{
+    size_t x;
+    for (x = 0; x < width; ++x)
+    {
+        size_t pos = x * 4;
+        dst[pos] = src[x];
+        dst[pos + 1] = src[x];
+        dst[pos + 2] = src[x];
+        dst[pos + 3] = 255;
+    }
+}
+
+void grayKeyToRgba(const byte* src, byte key, byte* dst, size_t width)
+{
+    size_t x;
+    for (x = 0; x < width; ++x)
+    {
+        size_t pos = x * 4;
+        dst[pos] = src[x];
+        dst[pos + 1] = src[x];
+        dst[pos + 2] = src[x];
+        dst[pos + 3] = (byte)-(src[x] != key);
+    }
+}
+
+void grayAlphaToRgba(const byte* src, byte* dst, size_t width)
+{
+    size_t x;
+    for (x = 0; x < width; ++x)
+    {
+        size_t pos = x * 4;
+        dst[pos] = src[x * 2];
+        dst[pos + 1] = src[x * 2];
+        dst[pos + 2] = src[x * 2];
+        dst[pos + 3] = src[x * 2 + 1];
+    }
+}
+
+void rgbToRgba(const byte* src, byte* dst, size_t width)
+{
+    size_t x = 0;
+#ifdef LIBIMAGE_SSSE3
+    /*
+     * 4 pixels per iteration, the load reads 16 of the 12 bytes so the loop stops 2 pixels early
+     */
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    for (; x + 6 <= width; x += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(src + x * 3));
+        _mm_storeu_si128((__m128i*)(dst + x * 4), _mm_or_si128(_mm_shuffle_epi8(pixels, spread), alpha));
+    }
+#endif
+    for (; x < width; ++x)
+    {
+        size_t pos = x * 4, srcPos = x * 3;
+        dst[pos] = src[srcPos];
+        dst[pos + 1] = src[srcPos + 1];
+        dst[pos + 2] = src[srcPos + 2];
+        dst[pos + 3] = 255;
+    }
+}
+
+void rgbKeyToRgba(const byte* src, const byte* key, byte* dst, size_t width)
+{
+    size_t x;
+    for (x = 0; x < width; ++x)
+    {
+        size_t pos = x * 4, srcPos = x * 3;
+        dst[pos] = src[srcPos];
+        dst[pos + 1] = src[srcPos + 1];
+        dst[pos + 2] = src[srcPos + 2];
+        dst[pos + 3] = (byte)-(src[srcPos] != key[0] || src[srcPos + 1] != key[1] || src[srcPos + 2] != key[2]);
+    }
+}
+
+void rgbaToRgb(const byte* src, byte* dst, size_t width)
+{
+    size_t x;
+    for (x = 0; x < width; ++x)
+    {
+        size_t pos = x * 3, srcPos = x * 4;
+        dst[pos] = src[srcPos];
+        dst[pos + 1] = src[srcPos + 1];
+        dst[pos + 2] = src[srcPos + 2];
+    }
+}
+
+void rgbaToGray(const byte* src, byte* dst, size_t width)
+{
+    size_t x;
+    for (x = 0; x < width; ++x)
+    {
+        size_t pos = x * 4;
+        dst[x] = (byte)((77 * src[pos] + 150 * src[pos + 1] + 29 * src[pos + 2] + 128) >> 8);
+    }
+}
+
+void premultiplyRgba(byte* pixels, size_t width)
+{
+    size_t x = 0;
+#ifdef LIBIMAGE_SSE2
+    /*
+     * 4 pixels per iteration widened to 16-bit lanes, the alpha lanes are multiplied by 255
+     * so they come out unchanged from the same rounding division as the color lanes
+     */
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i colorLanes = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i alphaLanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    const __m128i half = _mm_set1_epi16(128);
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i packed = _mm_loadu_si128((const __m128i*)(pixels + x * 4));
+        __m128i halves[2] = { _mm_unpacklo_epi8(packed, zero), _mm_unpackhi_epi8(packed, zero) };
+        int i;
+        for (i = 0; i < 2; ++i)
+        {
+            __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(halves[i], _MM_SHUFFLE(3, 3, 3, 3)),
+                _MM_SHUFFLE(3, 3, 3, 3));
+            alpha = _mm_or_si128(_mm_and_si128(alpha, colorLanes), alphaLanes);
+            __m128i product = _mm_add_epi16(_mm_mullo_epi16(halves[i], alpha), half);
+            halves[i] = _mm_srli_epi16(_mm_add_epi16(product, _mm_srli_epi16(product, 8)), 8);
+        }
+        _mm_storeu_si128((__m128i*)(pixels + x * 4), _mm_packus_epi16(halves[0], halves[1]));
+    }
+#endif
+    for (; x < width; ++x)
+    {
+        size_t pos = x * 4;
+        int alpha = pixels[pos + 3], i;
+        for (i = 0; i < 3; ++i)
+        {
+            int product = pixels[pos + i] * alpha + 128;
+            pixels[pos + i] = (byte)((product + (product >> 8)) >> 8);
+        }
+    }
+}
+
+void freeRows(byte** rowPtrs, size_t height)
+{
+    size_t i;
+    for (i = 0; i < height; ++i)
+    {
+        free(rowPtrs[i]);
+    }
+    free(rowPtrs);
+}
+
+void freeImage(Image* image)
+{
+    freeRows(image->rowPtrs, image->height);
+    free(image);
+}
+
+bool saveImage(Image* image, const char* format, byte** outBuffer)
+{
+    Buffer encoded = { NULL, 0 };
+    if (!saveImageToBuffer(image, format, &encoded))
+    {
+        return false;
+    }
+    *outBuffer = encoded.buf;
+    return true;
+}
+
+enum format saveFormatDictionary(const char* format)
+{
+    if (!format)
+    {
+        return NoneFormat;
+    }
+    if (formatCompIgnoreCase(format, PNG))
+    {
+        return Png;
+    }
+    /*
+     * if (formatCompIgnoreCase(format, JPEG))
+     *     return Jpeg;
+     * to be enabled together with handleSaveJpeg
+     */
+    return NoneFormat;
+}
+
+bool saveImageToBuffer(Image* image, const char* format, Buffer* outBuffer)
+{
+    return saveImageJob(image, format, outBuffer, NULL);
+}
+
+bool saveImageJob(Image* image, const char* format, Buffer* outBuffer, ImageJob* job)
+{
+    if (!image || !format)
+    {
+        return false;
+    }
+
+    if (formatCompIgnoreCase(format, PNG))
+    {
+        return handleSavePng(image, outBuffer, job);
+    }
+    if (formatCompIgnoreCase(format, JPEG))
+    {
+        /*
+         * return handleSaveJpeg(image, retBuffer);
+         * support for the format can be added easily in the future
+         */
+    }
+
+    return false;
+}
+
+bool handleSavePng(Image* image, Buffer* outBuffer, ImageJob* job)
+{
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr)
+    {
+        printf("creation of png_structp failed\n");
+        return false;
+    }
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr)
+    {
+        printf("creation of png_infop failed\n");
+        png_destroy_write_struct(&png_ptr, NULL);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        printf("failed setting header info\n");
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        return false;
+    }
+    png_set_IHDR(png_ptr, info_ptr, image->width, image->height, image->bitDepth, image->colorTypeVal,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+    png_set_compression_level(png_ptr, 1);
+    png_set_filter(png_ptr, 0, PNG_ALL_FILTERS);
+
+    byte* emptyBuffer = NULL;
+    Buffer pngWriteBuffer = { emptyBuffer, 0 };
+    png_set_write_fn(png_ptr, &pngWriteBuffer, writeToBuffer, NULL);
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        printf("failed writing image data\n");
+        if (pngWriteBuffer.buf)
+        {
+            free(pngWriteBuffer.buf);
+        }
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        return false;
+    }
+
+    /*
+     * equivalent to png_write_png with the identity transform, split in to
+     * bands so a cancelled job stops early
+     */
+    png_write_info(png_ptr, info_ptr);
+    size_t y;
+    for (y = 0; y < image->height; y += JOB_BAND_ROWS)
+    {
+        if (isJobCancelled(job))
+        {
+            printf("writing the image was cancelled\n");
+            if (pngWriteBuffer.buf)
+            {
+                free(pngWriteBuffer.buf);
+            }
+            png_destroy_write_struct(&png_ptr, &info_ptr);
+            return false;
+        }
+        size_t band = image->height - y < JOB_BAND_ROWS ? image->height - y : JOB_BAND_ROWS;
+        png_write_rows(png_ptr, image->rowPtrs + y, band);
+    }
+    png_write_end(png_ptr, info_ptr);
+
+    freeRows(image->rowPtrs, image->height);
+    free(image);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    *outBuffer = pngWriteBuffer;
+    return true;
+}
+
+bool averageImage(int avgDim, Image* image)
+{
+    return averageImageJob(avgDim, AverageBox, image, NULL);
+}
+
+bool averageImageWithMode(int avgDim, enum averageMode mode, Image* image)
+{
+    return averageImageJob(avgDim, mode, image, NULL);
+}
+
+bool averageImageJob(int avgDim, enum averageMode mode, Image* image, ImageJob* job)
+{
+    if (avgDim <= 0 || (size_t)avgDim > image->width || (size_t)avgDim > image->height)
+    {
+        return false;
+    }
+    if (image->colorTypeEnum == RGBA && image->bitDepth == 8)
+    {
+        if (mode == AverageLinear)
+        {
+            return handleEightBitRgbaLinearAveraging(image, avgDim, job);
+        }
+        return handleEightBitRgbaAveraging(image, avgDim, job);
+    }
+    return false;
+}
+
+bool handleEightBitRgbaAveraging(Image* image, int avgDim, ImageJob* job)
+{
+    size_t newHeight = image->height / avgDim;
+    size_t newWidth = image->width / avgDim;
+    int travDistance = avgDim - 1;
+    byte** rows = image->rowPtrs;
+
+    byte** newRows = createAvgImage(rows, newHeight, newWidth, avgDim, job);
+    if (!newRows)
+    {
+        return false;
+    }
+
+    freeRows(rows, image->height);
+    image->height = newHeight;
+    image->width = newWidth;
+    image->rowPtrs = newRows;
+
+    return true;
+}
+
+byte** createAvgImage(byte** rows, size_t newHeight, size_t newWidth, int numOfImgs, ImageJob* job)
+{
+    byte** newRows = (byte**)malloc(sizeof(byte*) * newHeight);
+    if (!newRows)
+    {
+        printf("failed to allocate memory for averaged image");
+        return NULL;
+    }
+
+    size_t y, x;
+    for (y = 0; y < newHeight; ++y)
+    {
+        if (y % JOB_BAND_ROWS == 0 && isJobCancelled(job))
+        {
+            printf("averaging the image was cancelled\n");
+            freeRows(newRows, y);
+            return NULL;
+        }
+        byte* row = rows[y];
+        byte* newRow = (byte*)malloc(sizeof(byte) * newWidth * 4);
+        if (!newRow)
+        {
+            printf("failed to allocate memory for averaged image");
+            freeRows(newRows, y);
+            return NULL;
+        }
+        newRows[y] = newRow;
+        for (x = 0; x < newWidth; ++x)
+        {
+            size_t pos = x * 4;
+            int avgs[4] = { 0 };
+            calcAverage(rows, numOfImgs, pos * numOfImgs, y * numOfImgs, avgs);
+            newRow[pos++] = avgs[0];
+            newRow[pos++] = avgs[1];
+            newRow[pos++] = avgs[2];
+            newRow[pos] = avgs[3];
+        }
+    }
+    return newRows;
+}
+
+void calcAverage(byte** rows, int avgDim, size_t start_x, size_t start_y, int* avgs)
+{
+    int y = 0, x = 0;
+    int sum[4] = { 0 };
+    for (y = 0; y < avgDim; ++y)
+    {
+        byte* row = rows[y + start_y];
+        for (x = 0; x < avgDim * 4; x += 4)
+        {
+            size_t pos = x + start_x;
+            sum[0] += row[pos++];
+            sum[1] += row[pos++];
+            sum[2] += row[pos++];
+            sum[3] += row[pos];
+        }
+    }
+    int i, size = avgDim * avgDim;
+    for (i = 0; i < 4; ++i)
+    {
+        avgs[i] = sum[i] / size;
+    }
+}
+
+void initLinearLuts(void)
+{
+    int i;
+    for (i = 0; i < 256; ++i)
+    {
+        double srgb = i / 255.0;
+        double linear = srgb <= 0.04045 ? srgb / 12.92 : pow((srgb + 0.055) / 1.055, 2.4);
+        srgbToLinearLut[i] = (uint16_t)(linear * 65535.0 + 0.5);
+    }
+    for (i = 0; i < LINEAR_LUT_L; ++i)
+    {
+        double linear = (i * LINEAR_LUT_STEP + LINEAR_LUT_STEP / 2.0) / 65535.0;
+        double srgb = linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1.0 / 2.4) - 0.055;
+        linearToSrgbLut[i] = (byte)(srgb * 255.0 + 0.5);
+    }
+}
+
+bool handleEightBitRgbaLinearAveraging(Image* image, int avgDim, ImageJob* job)
+{
+    callOnce(&linearLutsOnce, initLinearLuts);
+
+    size_t newHeight = image->height / avgDim;
+    size_t newWidth = image->width / avgDim;
+    byte** rows = image->rowPtrs;
+
+    uint64_t* blockSums = (uint64_t*)malloc(sizeof(uint64_t) * (newWidth * 4 + 1));
+    byte** newRows = (byte**)malloc(sizeof(byte*) * (newHeight + 1));
+    if (!blockSums || !newRows)
+    {
+        printf("failed to allocate memory for averaged image");
+        free(blockSums);
+        free(newRows);
+        return false;
+    }
+
+    /*
+     * every source row of a band is linearized, weighted and collapsed horizontally in
+     * one pass, so the band only keeps one set of sums per output pixel
+     */
+    size_t y;
+    int r;
+    for (y = 0; y < newHeight; ++y)
+    {
+        byte* newRow = NULL;
+        if (y % JOB_BAND_ROWS == 0 && isJobCancelled(job))
+        {
+            printf("averaging the image was cancelled\n");
+        }
+        else
+        {
+            newRow = (byte*)malloc(sizeof(byte) * newWidth * 4 + 1);
+            if (!newRow)
+            {
+                printf("failed to allocate memory for averaged image");
+            }
+        }
+        if (!newRow)
+        {
+            freeRows(newRows, y);
+            free(blockSums);
+            return false;
+        }
+        newRows[y] = newRow;
+
+        memset(blockSums, 0, sizeof(uint64_t) * newWidth * 4);
+        for (r = 0; r < avgDim; ++r)
+        {
+            accumulateLinearRow(rows[y * avgDim + r], blockSums, newWidth, avgDim);
+        }
+        resolveLinearRow(blockSums, newRow, newWidth, avgDim);
+    }
+
+    free(blockSums);
+    freeRows(rows, image->height);
+    image->height = newHeight;
+    image->width = newWidth;
+    image->rowPtrs = newRows;
+
+    return true;
+}
+
+void accumulateLinearRow(const byte* row, uint64_t* blockSums, size_t newWidth, int avgDim)
+{
+    /*
+     * the linear values are weighted by alpha without scaling them down, a block of a
+     * row fits in 64 bits for any avgDim and the division happens once in resolveLinearRow.
+     * the lut lookups don't vectorize without a gather, so this stays scalar and keeps the
+     * running sums in registers instead of storing them for every source pixel
+     */
+    size_t x;
+    int k;
+    const byte* px = row;
+    for (x = 0; x < newWidth * 4; x += 4)
+    {
+        uint64_t sum[4] = { 0 };
+        for (k = 0; k < avgDim; ++k, px += 4)
+        {
+            uint32_t alpha = px[3];
+            sum[0] += srgbToLinearLut[px[0]] * alpha;
+            sum[1] += srgbToLinearLut[px[1]] * alpha;
+            sum[2] += srgbToLinearLut[px[2]] * alpha;
+            sum[3] += alpha;
+        }
+        blockSums[x] += sum[0];
+        blockSums[x + 1] += sum[1];
+        blockSums[x + 2] += sum[2];
+        blockSums[x + 3] += sum[3];
+    }
+}
+
+void resolveLinearRow(const uint64_t* blockSums, byte* newRow, size_t newWidth, int avgDim)
+{
+    uint64_t size = (uint64_t)avgDim * avgDim;
+    size_t x;
+    int c;
+    for (x = 0; x < newWidth * 4; x += 4)
+    {
+        /*
+         * the color sums are weighted by alpha, so dividing by the alpha sum gives back the
+         * alpha-weighted linear average. one reciprocal per pixel instead of a 64-bit
+         * division per channel, it only has to pick one of the LINEAR_LUT_L entries
+         */
+        uint64_t alphaSum = blockSums[x + 3];
+        double scale = alphaSum ? 1.0 / ((double)alphaSum * LINEAR_LUT_STEP) : 0.0;
+        for (c = 0; c < 3; ++c)
+        {
+            size_t index = (size_t)((blockSums[x + c] + alphaSum / 2) * scale);
+            newRow[x + c] = linearToSrgbLut[index < LINEAR_LUT_L ? index : LINEAR_LUT_L - 1];
+        }
+        newRow[x + 3] = (byte)((alphaSum + size / 2) / size);
+    }
+}
+
+bool paveImage(int numOfImgs, Image* image, Image*** imageChunks)
+{
+    if (image->colorTypeEnum == RGBA && image->bitDepth == 8)
+    {
+        return handleEightBitRgbaPaving(image, numOfImgs, imageChunks);
+    }
+    return false;
+}
+
+bool handleEightBitRgbaPaving(Image* image, int numOfImgs, Image*** imageChunks)
+{
+    /*
+     * every chunk has to hold at least one pixel, the trimmed edges are what's left of
+     * the non-divisible dimensions
+     */
+    if (numOfImgs <= 0 || (size_t)numOfImgs > image->width || (size_t)numOfImgs > image->height)
+    {
+        printf("cannot pave the image in to %d chunks per dimension\n", numOfImgs);
+        return false;
+    }
+
+    size_t newHeight = image->height / numOfImgs;
+    size_t newWidth = image->width / numOfImgs;
+    byte** rows = image->rowPtrs;
+    int travDistance = numOfImgs - 1;
+    int i, size = numOfImgs * numOfImgs;
+    byte*** newRowsList = (byte***)malloc(sizeof(byte**) * size);
+    if (!newRowsList)
+    {
+        printf("allocation for chunked image list failed\n");
+        return false;
+    }
+
+    int outerX, outerY;
+    size_t y, x;
+    for (outerY = 0; outerY < numOfImgs; ++outerY)
+    {
+        for (outerX = 0; outerX < numOfImgs; ++outerX)
+        {
+            int chunkOffest = outerY * numOfImgs + outerX;
             byte** newRows = (byte**)malloc(sizeof(byte*) * newHeight);
             if (!newRows)
             {
-                printf("allocation for chunked image list failed\n");
-                for (i = 0; i < chunkOffest; ++i)
-                {
-                    freeRows(newRowsList[i], newHeight);
-                }
-                return false;
+                printf("allocation for chunked image list failed\n");
+                for (i = 0; i < chunkOffest; ++i)
+                {
+                    freeRows(newRowsList[i], newHeight);
+                }
+                free(newRowsList);
+                return false;
+            }
+
+            newRowsList[chunkOffest] = newRows;
+            size_t y_offest = outerY * newHeight;
+            size_t x_offest = outerX * newWidth * 4;
+            for (y = 0; y < newHeight; ++y)
+            {
+                byte* row = rows[y + y_offest];
+                byte* newRow = (byte*)malloc(sizeof(byte) * newWidth * 4);
+                if (!newRow)
+                {
+                    printf("allocation for chunked image list failed\n");
+                    freeRows(newRows, y);
+                    for (i = 0; i < chunkOffest; ++i)
+                    {
+                        freeRows(newRowsList[i], newHeight);
+                    }
+                    free(newRowsList);
+                    return false;
+                }
+
+                newRows[y] = newRow;
+                for (x = 0; x < newWidth; ++x)
+                {
+                    unsigned int pos = x * 4;
+                    newRow[pos] = row[pos + x_offest];
+                    newRow[pos + 1] = row[pos + x_offest + 1];
+                    newRow[pos + 2] = row[pos + x_offest + 2];
+                    newRow[pos + 3] = row[pos + x_offest + 3];
+                }
+            }
+        }
+    }
+
+    Image** images = (Image**)malloc(sizeof(Image*) * size);
+    if (!images)
+    {
+        printf("allocation for chunked image list failed\n");
+        for (i = 0; i < size; ++i)
+        {
+            freeRows(newRowsList[i], newHeight);
+        }
+        free(newRowsList);
+        return false;
+    }
+
+    for (i = 0; i < size; ++i)
+    {
+        images[i] = (Image*)malloc(sizeof(Image));
+        if (!images[i])
+        {
+            printf("allocation for chunked image list failed\n");
+            int j;
+            for (j = 0; j < i; ++j)
+            {
+                free(images[j]);
+            }
+            for (j = 0; j < size; ++j)
+            {
+                freeRows(newRowsList[j], newHeight);
+            }
+            free(images);
+            free(newRowsList);
+            return false;
+        }
+        images[i]->height = newHeight;
+        images[i]->width = newWidth;
+        images[i]->bitDepth = image->bitDepth;
+        images[i]->colorTypeVal = image->colorTypeVal;
+        images[i]->colorTypeEnum = image->colorTypeEnum;
+        images[i]->rowPtrs = newRowsList[i];
+    }
+    free(newRowsList);
+
+    *imageChunks = images;
+
+    return true;
+}
+
+int colorTypeChannels(enum colorType colorTypeEnum)
+{
+    switch (colorTypeEnum)
+    {
+    case GrayScale:
+    case PLTE:
+        return 1;
+    case GSA:
+        return 2;
+    case RGB:
+        return 3;
+    case RGBA:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+size_t imageRowBytes(const Image* image, size_t width)
+{
+    size_t bits = width * colorTypeChannels(image->colorTypeEnum) * image->bitDepth;
+    return (bits + 7) / 8;
+}
+
+Pipeline* createPipeline(void)
+{
+    Pipeline* pipeline = (Pipeline*)calloc(1, sizeof(Pipeline));
+    if (!pipeline)
+    {
+        printf("allocation for pipeline failed\n");
+    }
+    return pipeline;
+}
+
+void freePipeline(Pipeline* pipeline)
+{
+    free(pipeline);
+}
+
+bool addPipelineStep(Pipeline* pipeline, const PipelineStep* step)
+{
+    if (!pipeline || pipeline->numOfSteps == PIPELINE_MAX_STEPS)
+    {
+        return false;
+    }
+    pipeline->steps[pipeline->numOfSteps++] = *step;
+    return true;
+}
+
+bool pipelineOpen(Pipeline* pipeline, byte* inBuffer, size_t inSize, const DecodeOptions* options)
+{
+    if (!checkDecodeOptions(options))
+    {
+        return false;
+    }
+    PipelineStep step = { OpOpen };
+    step.inBuffer = inBuffer;
+    step.inSize = inSize;
+    if (options)
+    {
+        step.options = *options;
+    }
+    return addPipelineStep(pipeline, &step);
+}
+
+bool pipelineCrop(Pipeline* pipeline, size_t x, size_t y, size_t width, size_t height)
+{
+    PipelineStep step = { OpCrop };
+    step.x = x;
+    step.y = y;
+    step.width = width;
+    step.height = height;
+    return addPipelineStep(pipeline, &step);
+}
+
+bool pipelineAverage(Pipeline* pipeline, int avgDim)
+{
+    return pipelineAverageWithMode(pipeline, avgDim, AverageBox);
+}
+
+bool pipelineAverageWithMode(Pipeline* pipeline, int avgDim, enum averageMode mode)
+{
+    PipelineStep step = { OpAverage };
+    step.param = avgDim;
+    step.mode = mode;
+    return addPipelineStep(pipeline, &step);
+}
+
+bool pipelinePave(Pipeline* pipeline, int numOfImgs)
+{
+    PipelineStep step = { OpPave };
+    step.param = numOfImgs;
+    return addPipelineStep(pipeline, &step);
+}
+
+bool pipelineSave(Pipeline* pipeline, const char* format)
+{
+    PipelineStep step = { OpSave };
+    step.format = format;
+    return addPipelineStep(pipeline, &step);
+}
+
+void paveView(const PipelineView* view, int numOfImgs, int tile, PipelineView* tileView)
+{
+    size_t tileWidth = view->width / view->avgDim / numOfImgs;
+    size_t tileHeight = view->height / view->avgDim / numOfImgs;
+    tileView->x = view->x + (tile % numOfImgs) * tileWidth * view->avgDim;
+    tileView->y = view->y + (tile / numOfImgs) * tileHeight * view->avgDim;
+    tileView->width = tileWidth * view->avgDim;
+    tileView->height = tileHeight * view->avgDim;
+    tileView->avgDim = view->avgDim;
+    tileView->mode = view->mode;
+}
+
+byte* viewRow(Image* source, const PipelineView* view, size_t row, byte* scratch)
+{
+    if (view->avgDim == 1 && view->mode == AverageBox)
+    {
+        return source->rowPtrs[view->y + row] + view->x * 4;
+    }
+
+    size_t x, width = view->width / view->avgDim;
+    size_t start_x = view->x * 4, start_y = view->y + row * view->avgDim;
+    size_t step = view->avgDim * 4;
+    if (view->mode == AverageLinear)
+    {
+        /*
+         * same sums as handleEightBitRgbaLinearAveraging, kept per output pixel so the
+         * view doesn't need a band buffer next to the scratch row
+         */
+        callOnce(&linearLutsOnce, initLinearLuts);
+        int r;
+        for (x = 0; x < width; ++x)
+        {
+            uint64_t blockSums[4] = { 0 };
+            for (r = 0; r < view->avgDim; ++r)
+            {
+                accumulateLinearRow(source->rowPtrs[start_y + r] + start_x + x * step, blockSums, 1, view->avgDim);
+            }
+            resolveLinearRow(blockSums, scratch + x * 4, 1, view->avgDim);
+        }
+        return scratch;
+    }
+    for (x = 0; x < width; ++x)
+    {
+        size_t pos = x * 4;
+        int avgs[4] = { 0 };
+        calcAverage(source->rowPtrs, view->avgDim, start_x + x * step, start_y, avgs);
+        scratch[pos++] = avgs[0];
+        scratch[pos++] = avgs[1];
+        scratch[pos++] = avgs[2];
+        scratch[pos] = avgs[3];
+    }
+    return scratch;
+}
+
+bool materializeView(Image* source, const PipelineView* view, Image** image)
+{
+    size_t newHeight = view->height / view->avgDim;
+    size_t newWidth = view->width / view->avgDim;
+    size_t rowBytes = imageRowBytes(source, newWidth);
+
+    byte** newRows = (byte**)malloc(sizeof(byte*) * newHeight);
+    if (!newRows && newHeight)
+    {
+        printf("allocation for pipeline image failed\n");
+        return false;
+    }
+    size_t y;
+    for (y = 0; y < newHeight; ++y)
+    {
+        byte* newRow = (byte*)malloc(sizeof(byte) * rowBytes);
+        if (!newRow)
+        {
+            printf("allocation for pipeline image failed\n");
+            freeRows(newRows, y);
+            return false;
+        }
+        newRows[y] = newRow;
+        byte* row = viewRow(source, view, y, newRow);
+        if (row != newRow)
+        {
+            memcpy(newRow, row, rowBytes);
+        }
+    }
+
+    Image* img = (Image*)malloc(sizeof(Image));
+    if (!img)
+    {
+        printf("allocation for pipeline image failed\n");
+        freeRows(newRows, newHeight);
+        return false;
+    }
+    img->height = newHeight;
+    img->width = newWidth;
+    img->bitDepth = source->bitDepth;
+    img->colorTypeVal = source->colorTypeVal;
+    img->colorTypeEnum = source->colorTypeEnum;
+    img->rowPtrs = newRows;
+
+    *image = img;
+    return true;
+}
+
+bool handleSavePngView(Image* source, const PipelineView* view, Buffer* outBuffer)
+{
+    size_t height = view->height / view->avgDim;
+    size_t width = view->width / view->avgDim;
+
+    /*
+     * averaged rows are computed in to a single scratch row right before libpng consumes them
+     */
+    byte* scratch = NULL;
+    if (view->avgDim > 1 || view->mode == AverageLinear)
+    {
+        scratch = (byte*)malloc(sizeof(byte) * (imageRowBytes(source, width) + 1));
+        if (!scratch)
+        {
+            printf("allocation for pipeline row failed\n");
+            return false;
+        }
+    }
+
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr)
+    {
+        printf("creation of png_structp failed\n");
+        free(scratch);
+        return false;
+    }
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr)
+    {
+        printf("creation of png_infop failed\n");
+        png_destroy_write_struct(&png_ptr, NULL);
+        free(scratch);
+        return false;
+    }
+
+    Buffer pngWriteBuffer = { NULL, 0 };
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        printf("failed writing image data\n");
+        if (pngWriteBuffer.buf)
+        {
+            free(pngWriteBuffer.buf);
+        }
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        free(scratch);
+        return false;
+    }
+
+    png_set_IHDR(png_ptr, info_ptr, width, height, source->bitDepth, source->colorTypeVal,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_compression_level(png_ptr, 1);
+    png_set_filter(png_ptr, 0, PNG_ALL_FILTERS);
+    png_set_write_fn(png_ptr, &pngWriteBuffer, writeToBuffer, NULL);
+
+    png_write_info(png_ptr, info_ptr);
+    size_t y;
+    for (y = 0; y < height; ++y)
+    {
+        png_write_row(png_ptr, viewRow(source, view, y, scratch));
+    }
+    png_write_end(png_ptr, NULL);
+
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(scratch);
+
+    *outBuffer = pngWriteBuffer;
+    return true;
+}
+
+void freePipelineResult(PipelineResult* result)
+{
+    int i;
+    if (result->images)
+    {
+        for (i = 0; i < result->numOfOutputs; ++i)
+        {
+            if (result->images[i])
+            {
+                freeImage(result->images[i]);
+            }
+        }
+        free(result->images);
+    }
+    freeBuffers(result->buffers, result->numOfOutputs);
+    result->images = NULL;
+    result->buffers = NULL;
+    result->numOfOutputs = 0;
+}
+
+bool runPipeline(Pipeline* pipeline, Image* image, PipelineResult* result)
+{
+    if (!pipeline || !result)
+    {
+        return false;
+    }
+
+    Image* source = image;
+    bool ownsSource = false;
+    int i = 0;
+    if (pipeline->numOfSteps > 0 && pipeline->steps[0].operation == OpOpen)
+    {
+        PipelineStep* openStep = &pipeline->steps[0];
+        if (!openImageWithOptions(openStep->inBuffer, openStep->inSize, &openStep->options, &source))
+        {
+            return false;
+        }
+        ownsSource = true;
+        i = 1;
+    }
+    if (!source)
+    {
+        return false;
+    }
+
+    /*
+     * fold the recorded steps in to a single view over the source
+     */
+    bool isEightBitRgba = source->colorTypeEnum == RGBA && source->bitDepth == 8;
+    PipelineView view = { 0, 0, source->width, source->height, 1, AverageBox };
+    int numOfImgs = 0;
+    const char* format = NULL;
+    bool valid = true;
+    for (; i < pipeline->numOfSteps && valid; ++i)
+    {
+        PipelineStep* step = &pipeline->steps[i];
+        if (format || (numOfImgs && step->operation != OpSave))
+        {
+            valid = false;
+            break;
+        }
+        switch (step->operation)
+        {
+        case OpCrop:
+            /*
+             * compared as differences, x + width could wrap around for huge offsets
+             */
+            valid = isEightBitRgba && step->width && step->height &&
+                step->x <= view.width / view.avgDim &&
+                step->width <= view.width / view.avgDim - step->x &&
+                step->y <= view.height / view.avgDim &&
+                step->height <= view.height / view.avgDim - step->y;
+            if (valid)
+            {
+                view.x += step->x * view.avgDim;
+                view.y += step->y * view.avgDim;
+                view.width = step->width * view.avgDim;
+                view.height = step->height * view.avgDim;
+            }
+            break;
+        case OpAverage:
+            valid = isEightBitRgba && step->param > 0 &&
+                (size_t)step->param <= view.width / view.avgDim &&
+                (size_t)step->param <= view.height / view.avgDim;
+            if (valid && (view.avgDim > 1 || view.mode == AverageLinear))
+            {
+                /*
+                 * stacked averages don't compose exactly because of the integer
+                 * division, so the pending one is applied before the next is folded
+                 */
+                Image* intermediate;
+                valid = materializeView(source, &view, &intermediate);
+                if (valid)
+                {
+                    if (ownsSource)
+                    {
+                        freeImage(source);
+                    }
+                    source = intermediate;
+                    ownsSource = true;
+                    view.x = view.y = 0;
+                    view.width = source->width;
+                    view.height = source->height;
+                }
+            }
+            view.avgDim = step->param;
+            view.mode = step->mode;
+            break;
+        case OpPave:
+            valid = isEightBitRgba && step->param > 0 &&
+                (size_t)step->param <= view.width / view.avgDim &&
+                (size_t)step->param <= view.height / view.avgDim;
+            numOfImgs = step->param;
+            break;
+        case OpSave:
+            valid = saveFormatDictionary(step->format) == Png;
+            format = step->format;
+            break;
+        default:
+            valid = false;
+            break;
+        }
+    }
+
+    PipelineResult out = { NULL, NULL, numOfImgs ? numOfImgs * numOfImgs : 1 };
+    if (valid)
+    {
+        if (format)
+        {
+            out.buffers = (Buffer*)calloc(out.numOfOutputs, sizeof(Buffer));
+            valid = out.buffers != NULL;
+        }
+        else
+        {
+            out.images = (Image**)calloc(out.numOfOutputs, sizeof(Image*));
+            valid = out.images != NULL;
+        }
+        if (!valid)
+        {
+            printf("allocation for pipeline outputs failed\n");
+        }
+    }
+
+    bool isIdentity = view.avgDim == 1 && view.mode == AverageBox && view.x == 0 && view.y == 0 &&
+        view.width == source->width && view.height == source->height;
+    for (i = 0; i < out.numOfOutputs && valid; ++i)
+    {
+        PipelineView tileView = view;
+        if (numOfImgs)
+        {
+            paveView(&view, numOfImgs, i, &tileView);
+        }
+
+        if (format)
+        {
+            valid = handleSavePngView(source, &tileView, &out.buffers[i]);
+        }
+        else if (!numOfImgs && isIdentity && ownsSource)
+        {
+            /*
+             * nothing left to apply, hand over the decoded source instead of copying it
+             */
+            out.images[i] = source;
+            ownsSource = false;
+        }
+        else
+        {
+            valid = materializeView(source, &tileView, &out.images[i]);
+        }
+    }
+
+    if (ownsSource)
+    {
+        freeImage(source);
+    }
+    if (!valid)
+    {
+        freePipelineResult(&out);
+        return false;
+    }
+    *result = out;
+    return true;
+}
+
+void initMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void lockMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void unlockMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void destroyMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void initCondition(Condition* condition)
+{
+#ifdef _WIN32
+    InitializeConditionVariable(condition);
+#else
+    pthread_cond_init(condition, NULL);
+#endif
+}
+
+void waitCondition(Condition* condition, Mutex* mutex)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(condition, mutex, INFINITE);
+#else
+    pthread_cond_wait(condition, mutex);
+#endif
+}
+
+void broadcastCondition(Condition* condition)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(condition);
+#else
+    pthread_cond_broadcast(condition);
+#endif
+}
+
+void destroyCondition(Condition* condition)
+{
+#ifdef _WIN32
+    (void)condition;
+#else
+    pthread_cond_destroy(condition);
+#endif
+}
+
+#ifdef _WIN32
+BOOL CALLBACK onceTrampoline(PINIT_ONCE once, PVOID init, PVOID* context)
+{
+    ((void (*)(void))init)();
+    return TRUE;
+}
+#endif
+
+void callOnce(Once* once, void (*init)(void))
+{
+#ifdef _WIN32
+    InitOnceExecuteOnce(once, onceTrampoline, (PVOID)init, NULL);
+#else
+    pthread_once(once, init);
+#endif
+}
+
+#ifdef _WIN32
+DWORD WINAPI workerThread(LPVOID arg)
+{
+    runExecutor((ImageExecutor*)arg);
+    return 0;
+}
+#else
+void* workerThread(void* arg)
+{
+    runExecutor((ImageExecutor*)arg);
+    return NULL;
+}
+#endif
+
+bool startWorkerThread(Thread* thread, ImageExecutor* executor)
+{
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, workerThread, executor, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, workerThread, executor) == 0;
+#endif
+}
+
+void joinThread(Thread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+unsigned long currentProcessId(void)
+{
+#ifdef _WIN32
+    return (unsigned long)GetCurrentProcessId();
+#else
+    return (unsigned long)getpid();
+#endif
+}
+
+double monotonicSeconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#else
+    /*
+     * the build picked a POSIX level without clock_gettime, the C11 wall clock still does
+     * for benchmark intervals
+     */
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+double processCpuSeconds(void)
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    ULARGE_INTEGER kernelTime, userTime;
+    kernelTime.LowPart = kernel.dwLowDateTime;
+    kernelTime.HighPart = kernel.dwHighDateTime;
+    userTime.LowPart = user.dwLowDateTime;
+    userTime.HighPart = user.dwHighDateTime;
+    return (double)(kernelTime.QuadPart + userTime.QuadPart) / 1e7;
+#elif defined(CLOCK_PROCESS_CPUTIME_ID)
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+ImageExecutor* createImageExecutor(int numOfThreads)
+{
+    if (numOfThreads <= 0)
+    {
+        return NULL;
+    }
+
+    ImageExecutor* executor = (ImageExecutor*)calloc(1, sizeof(ImageExecutor));
+    if (!executor)
+    {
+        printf("allocation for executor failed\n");
+        return NULL;
+    }
+    executor->threads = (Thread*)malloc(sizeof(Thread) * numOfThreads);
+    if (!executor->threads)
+    {
+        printf("allocation for executor failed\n");
+        free(executor);
+        return NULL;
+    }
+    initMutex(&executor->lock);
+    initCondition(&executor->available);
+
+    for (executor->numOfThreads = 0; executor->numOfThreads < numOfThreads; ++executor->numOfThreads)
+    {
+        if (!startWorkerThread(&executor->threads[executor->numOfThreads], executor))
+        {
+            printf("failed to start executor thread\n");
+            freeImageExecutor(executor);
+            return NULL;
+        }
+    }
+    return executor;
+}
+
+void freeImageExecutor(ImageExecutor* executor)
+{
+    if (!executor)
+    {
+        return;
+    }
+
+    lockMutex(&executor->lock);
+    executor->stopping = true;
+    ImageJob* pending = executor->queue;
+    executor->queue = NULL;
+    broadcastCondition(&executor->available);
+    unlockMutex(&executor->lock);
+
+    while (pending)
+    {
+        ImageJob* job = pending;
+        pending = job->next;
+        job->next = NULL;
+        lockMutex(&job->lock);
+        job->cancelled = true;
+        unlockMutex(&job->lock);
+        finishImageJob(job, false);
+    }
+
+    int i;
+    for (i = 0; i < executor->numOfThreads; ++i)
+    {
+        joinThread(executor->threads[i]);
+    }
+    destroyCondition(&executor->available);
+    destroyMutex(&executor->lock);
+    free(executor->threads);
+    free(executor);
+}
+
+ImageJob* createImageJob(enum jobOperation operation, enum jobPriority priority,
+    JobCallback callback, void* userData)
+{
+    ImageJob* job = (ImageJob*)calloc(1, sizeof(ImageJob));
+    if (!job)
+    {
+        printf("allocation for job failed\n");
+        return NULL;
+    }
+    job->operation = operation;
+    job->priority = priority;
+    job->callback = callback;
+    job->userData = userData;
+    job->state = JobPending;
+    initMutex(&job->lock);
+    initCondition(&job->done);
+    return job;
+}
+
+bool submitImageJob(ImageExecutor* executor, ImageJob* job)
+{
+    lockMutex(&executor->lock);
+    if (executor->stopping)
+    {
+        unlockMutex(&executor->lock);
+        return false;
+    }
+
+    /*
+     * the queue is kept sorted by priority, a new job goes after every job of its own priority
+     */
+    ImageJob** link = &executor->queue;
+    while (*link && (*link)->priority >= job->priority)
+    {
+        link = &(*link)->next;
+    }
+    job->next = *link;
+    *link = job;
+    job->executor = executor;
+
+    broadcastCondition(&executor->available);
+    unlockMutex(&executor->lock);
+    return true;
+}
+
+void runExecutor(ImageExecutor* executor)
+{
+    lockMutex(&executor->lock);
+    while (true)
+    {
+        while (!executor->queue && !executor->stopping)
+        {
+            waitCondition(&executor->available, &executor->lock);
+        }
+        ImageJob* job = executor->queue;
+        if (!job)
+        {
+            break;
+        }
+        executor->queue = job->next;
+        job->next = NULL;
+
+        unlockMutex(&executor->lock);
+        runImageJob(job);
+        lockMutex(&executor->lock);
+    }
+    unlockMutex(&executor->lock);
+}
+
+bool isJobCancelled(ImageJob* job)
+{
+    if (!job)
+    {
+        return false;
+    }
+    lockMutex(&job->lock);
+    bool cancelled = job->cancelled;
+    unlockMutex(&job->lock);
+    return cancelled;
+}
+
+void runImageJob(ImageJob* job)
+{
+    bool success = false;
+
+    lockMutex(&job->lock);
+    bool cancelled = job->cancelled;
+    if (!cancelled)
+    {
+        job->state = JobRunning;
+    }
+    unlockMutex(&job->lock);
+
+    if (!cancelled)
+    {
+        switch (job->operation)
+        {
+        case JobOpen:
+            success = openImageJob(job->inBuffer, job->inSize, &job->options, &job->image, job);
+            break;
+        case JobAverage:
+            success = averageImageJob(job->avgDim, job->mode, job->image, job);
+            break;
+        case JobSave:
+            success = saveImageJob(job->image, job->format, &job->buffer, job);
+            if (success)
+            {
+                job->image = NULL;
+            }
+            break;
+        }
+    }
+
+    finishImageJob(job, success);
+}
+
+void finishImageJob(ImageJob* job, bool success)
+{
+    lockMutex(&job->lock);
+    job->state = success ? JobDone : (job->cancelled ? JobCancelled : JobFailed);
+    unlockMutex(&job->lock);
+
+    if (job->callback)
+    {
+        job->callback(job, job->userData);
+    }
+
+    lockMutex(&job->lock);
+    job->finished = true;
+    bool detached = job->detached;
+    broadcastCondition(&job->done);
+    unlockMutex(&job->lock);
+
+    if (detached)
+    {
+        freeImageJob(job);
+    }
+}
+
+ImageJob* openImageAsync(ImageExecutor* executor, byte* inBuffer, size_t inSize, const DecodeOptions* options,
+    enum jobPriority priority, JobCallback callback, void* userData)
+{
+    if (!executor || !inBuffer || !checkDecodeOptions(options))
+    {
+        return NULL;
+    }
+    ImageJob* job = createImageJob(JobOpen, priority, callback, userData);
+    if (!job)
+    {
+        return NULL;
+    }
+    job->inBuffer = inBuffer;
+    job->inSize = inSize;
+    if (options)
+    {
+        job->options = *options;
+    }
+    if (!submitImageJob(executor, job))
+    {
+        freeImageJob(job);
+        return NULL;
+    }
+    return job;
+}
+
+ImageJob* averageImageAsync(ImageExecutor* executor, int avgDim, Image* image, enum jobPriority priority,
+    JobCallback callback, void* userData)
+{
+    return averageImageWithModeAsync(executor, avgDim, AverageBox, image, priority, callback, userData);
+}
+
+ImageJob* averageImageWithModeAsync(ImageExecutor* executor, int avgDim, enum averageMode mode, Image* image,
+    enum jobPriority priority, JobCallback callback, void* userData)
+{
+    if (!executor || !image || avgDim <= 0)
+    {
+        return NULL;
+    }
+    ImageJob* job = createImageJob(JobAverage, priority, callback, userData);
+    if (!job)
+    {
+        return NULL;
+    }
+    job->avgDim = avgDim;
+    job->mode = mode;
+    job->image = image;
+    if (!submitImageJob(executor, job))
+    {
+        freeImageJob(job);
+        return NULL;
+    }
+    return job;
+}
+
+ImageJob* saveImageAsync(ImageExecutor* executor, Image* image, const char* format, enum jobPriority priority,
+    JobCallback callback, void* userData)
+{
+    if (!executor || !image || !format)
+    {
+        return NULL;
+    }
+    ImageJob* job = createImageJob(JobSave, priority, callback, userData);
+    if (!job)
+    {
+        return NULL;
+    }
+    job->image = image;
+    job->format = format;
+    if (!submitImageJob(executor, job))
+    {
+        freeImageJob(job);
+        return NULL;
+    }
+    return job;
+}
+
+bool cancelImageJob(ImageJob* job)
+{
+    if (!job)
+    {
+        return false;
+    }
+    lockMutex(&job->lock);
+    bool finished = job->finished;
+    unlockMutex(&job->lock);
+    if (finished)
+    {
+        return false;
+    }
+
+    /*
+     * a job still in the queue is unlinked so waiting on it doesn't depend on the jobs
+     * queued ahead of it. the executor lock is taken before the job's, like the workers do
+     */
+    ImageExecutor* executor = job->executor;
+    bool unlinked = false;
+    lockMutex(&executor->lock);
+    lockMutex(&job->lock);
+    bool cancellable = job->state == JobPending || job->state == JobRunning;
+    if (cancellable)
+    {
+        job->cancelled = true;
+    }
+    if (job->state == JobPending)
+    {
+        ImageJob** link = &executor->queue;
+        while (*link && *link != job)
+        {
+            link = &(*link)->next;
+        }
+        if (*link)
+        {
+            *link = job->next;
+            job->next = NULL;
+            unlinked = true;
+        }
+    }
+    unlockMutex(&job->lock);
+    unlockMutex(&executor->lock);
+
+    if (unlinked)
+    {
+        finishImageJob(job, false);
+    }
+    return cancellable;
+}
+
+bool waitImageJob(ImageJob* job)
+{
+    if (!job)
+    {
+        return false;
+    }
+    lockMutex(&job->lock);
+    while (!job->finished)
+    {
+        waitCondition(&job->done, &job->lock);
+    }
+    bool success = job->state == JobDone;
+    unlockMutex(&job->lock);
+    return success;
+}
+
+void freeImageJob(ImageJob* job)
+{
+    if (!job)
+    {
+        return;
+    }
+    destroyCondition(&job->done);
+    destroyMutex(&job->lock);
+    free(job);
+}
+
+void detachImageJob(ImageJob* job)
+{
+    if (!job)
+    {
+        return;
+    }
+    lockMutex(&job->lock);
+    job->detached = true;
+    bool finished = job->finished;
+    unlockMutex(&job->lock);
+
+    if (finished)
+    {
+        freeImageJob(job);
+    }
+}
+
+uint64_t xxhRound(uint64_t acc, uint64_t lane)
+{
+    acc += lane * XXH_PRIME64_2;
+    acc = XXH_ROTL64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+uint64_t xxhMergeRound(uint64_t acc, uint64_t lane)
+{
+    acc ^= xxhRound(0, lane);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t hashBuffer(const byte* buf, size_t size, uint64_t seed)
+{
+    const byte* pos = buf;
+    const byte* end = buf + size;
+    uint64_t hash, lane;
+
+    if (size >= 32)
+    {
+        const byte* limit = end - 32;
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        do
+        {
+            memcpy(&lane, pos, 8);
+            v1 = xxhRound(v1, lane);
+            memcpy(&lane, pos + 8, 8);
+            v2 = xxhRound(v2, lane);
+            memcpy(&lane, pos + 16, 8);
+            v3 = xxhRound(v3, lane);
+            memcpy(&lane, pos + 24, 8);
+            v4 = xxhRound(v4, lane);
+            pos += 32;
+        } while (pos <= limit);
+
+        hash = XXH_ROTL64(v1, 1) + XXH_ROTL64(v2, 7) + XXH_ROTL64(v3, 12) + XXH_ROTL64(v4, 18);
+        hash = xxhMergeRound(hash, v1);
+        hash = xxhMergeRound(hash, v2);
+        hash = xxhMergeRound(hash, v3);
+        hash = xxhMergeRound(hash, v4);
+    }
+    else
+    {
+        hash = seed + XXH_PRIME64_5;
+    }
+
+    hash += (uint64_t)size;
+
+    while (pos + 8 <= end)
+    {
+        memcpy(&lane, pos, 8);
+        hash ^= xxhRound(0, lane);
+        hash = XXH_ROTL64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        pos += 8;
+    }
+    if (pos + 4 <= end)
+    {
+        uint32_t half;
+        memcpy(&half, pos, 4);
+        hash ^= (uint64_t)half * XXH_PRIME64_1;
+        hash = XXH_ROTL64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        pos += 4;
+    }
+    while (pos < end)
+    {
+        hash ^= (*pos) * XXH_PRIME64_5;
+        hash = XXH_ROTL64(hash, 11) * XXH_PRIME64_1;
+        ++pos;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+bool copyBuffers(const Buffer* src, int count, Buffer** dst)
+{
+    Buffer* buffers = (Buffer*)calloc(count, sizeof(Buffer));
+    if (!buffers)
+    {
+        printf("allocation for buffer copies failed\n");
+        return false;
+    }
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        buffers[i].buf = (byte*)malloc(sizeof(byte) * src[i].size);
+        if (!buffers[i].buf && src[i].size)
+        {
+            printf("allocation for buffer copies failed\n");
+            freeBuffers(buffers, i);
+            return false;
+        }
+        memcpy(buffers[i].buf, src[i].buf, src[i].size);
+        buffers[i].size = src[i].size;
+    }
+    *dst = buffers;
+    return true;
+}
+
+void freeBuffers(Buffer* buffers, int count)
+{
+    if (!buffers)
+    {
+        return;
+    }
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        free(buffers[i].buf);
+    }
+    free(buffers);
+}
+
+ImageCache* createImageCache(size_t memoryBudget, size_t diskBudget, const char* diskDir)
+{
+    ImageCache* cache = (ImageCache*)calloc(1, sizeof(ImageCache));
+    if (!cache)
+    {
+        printf("allocation for image cache failed\n");
+        return NULL;
+    }
+
+    cache->shardMemoryBudget = memoryBudget / CACHE_SHARDS;
+    if (diskDir && diskBudget)
+    {
+        size_t dirLen = strlen(diskDir);
+        cache->diskDir = (char*)malloc(dirLen + 1);
+        if (!cache->diskDir)
+        {
+            printf("allocation for image cache failed\n");
+            free(cache);
+            return NULL;
+        }
+        memcpy(cache->diskDir, diskDir, dirLen + 1);
+        cache->shardDiskBudget = diskBudget / CACHE_SHARDS;
+    }
+
+    callOnce(&cacheInstanceOnce, initCacheInstanceLock);
+    lockMutex(&cacheInstanceLock);
+    cache->instanceId = nextCacheInstance++;
+    unlockMutex(&cacheInstanceLock);
+    cache->processId = currentProcessId();
+
+    int i;
+    for (i = 0; i < CACHE_SHARDS; ++i)
+    {
+        initMutex(&cache->shards[i].lock);
+    }
+    return cache;
+}
+
+void freeImageCache(ImageCache* cache)
+{
+    if (!cache)
+    {
+        return;
+    }
+    size_t i, j;
+    for (i = 0; i < CACHE_SHARDS; ++i)
+    {
+        CacheShard* shard = &cache->shards[i];
+        for (j = 0; j < CACHE_BUCKETS; ++j)
+        {
+            while (shard->buckets[j])
+            {
+                CacheEntry* entry = shard->buckets[j];
+                detachCacheEntry(shard, entry);
+                destroyCacheEntry(cache, i, entry);
             }
+        }
+        destroyMutex(&shard->lock);
+    }
+    free(cache->diskDir);
+    free(cache);
+}
+
+bool makeCacheKey(const byte* inBuffer, size_t inSize, enum cacheOperation operation,
+    int param, enum averageMode mode, const char* format, CacheKey* key)
+{
+    enum format saveFormat = saveFormatDictionary(format);
+    if (saveFormat == NoneFormat)
+    {
+        return false;
+    }
+    memset(key, 0, sizeof(CacheKey));
+    key->inputHash = hashBuffer(inBuffer, inSize, 0);
+    key->inputSize = inSize;
+    key->operation = operation;
+    key->param = param;
+    key->mode = mode;
+    key->saveFormat = saveFormat;
+    return true;
+}
+
+size_t cacheKeySlot(const CacheKey* key, size_t* bucket)
+{
+    uint64_t slot = hashBuffer((const byte*)key, sizeof(CacheKey), 0);
+    *bucket = (size_t)((slot / CACHE_SHARDS) % CACHE_BUCKETS);
+    return (size_t)(slot % CACHE_SHARDS);
+}
+
+void initCacheInstanceLock(void)
+{
+    initMutex(&cacheInstanceLock);
+}
+
+bool sameCacheKey(const CacheKey* a, const CacheKey* b)
+{
+    return a->inputHash == b->inputHash && a->inputSize == b->inputSize &&
+        a->operation == b->operation && a->param == b->param && a->mode == b->mode &&
+        a->saveFormat == b->saveFormat;
+}
+
+CacheEntry* findCacheEntry(CacheShard* shard, const CacheKey* key, size_t bucket)
+{
+    CacheEntry* entry;
+    for (entry = shard->buckets[bucket]; entry; entry = entry->chainNext)
+    {
+        if (sameCacheKey(&entry->key, key))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void unlinkCacheLru(CacheEntry** head, CacheEntry** tail, CacheEntry* entry)
+{
+    if (entry->lruPrev)
+    {
+        entry->lruPrev->lruNext = entry->lruNext;
+    }
+    else
+    {
+        *head = entry->lruNext;
+    }
+    if (entry->lruNext)
+    {
+        entry->lruNext->lruPrev = entry->lruPrev;
+    }
+    else
+    {
+        *tail = entry->lruPrev;
+    }
+    entry->lruPrev = entry->lruNext = NULL;
+}
+
+void pushCacheLru(CacheEntry** head, CacheEntry** tail, CacheEntry* entry)
+{
+    entry->lruPrev = NULL;
+    entry->lruNext = *head;
+    if (*head)
+    {
+        (*head)->lruPrev = entry;
+    }
+    else
+    {
+        *tail = entry;
+    }
+    *head = entry;
+}
+
+void cacheEntryPath(ImageCache* cache, size_t shardIdx, unsigned long fileId, char* path, size_t pathLen)
+{
+    snprintf(path, pathLen, "%s/libimage-%lu-%lu-%02u-%lu.cache", cache->diskDir, cache->processId,
+        cache->instanceId, (unsigned int)shardIdx, fileId);
+}
+
+void detachCacheEntry(CacheShard* shard, CacheEntry* entry)
+{
+    size_t bucket;
+    cacheKeySlot(&entry->key, &bucket);
+    CacheEntry** link = &shard->buckets[bucket];
+    while (*link != entry)
+    {
+        link = &(*link)->chainNext;
+    }
+    *link = entry->chainNext;
+    entry->chainNext = NULL;
+
+    /*
+     * entries that are being spilled or read are off the LRU lists already
+     */
+    if (entry->onDisk)
+    {
+        if (!entry->pins)
+        {
+            unlinkCacheLru(&shard->diskHead, &shard->diskTail, entry);
+        }
+        shard->diskUsed -= entry->size;
+    }
+    else if (!entry->spilling)
+    {
+        unlinkCacheLru(&shard->memHead, &shard->memTail, entry);
+        shard->memUsed -= entry->size;
+    }
+}
+
+void destroyCacheEntry(ImageCache* cache, size_t shardIdx, CacheEntry* entry)
+{
+    if (entry->onDisk)
+    {
+        char path[CACHE_PATH_L];
+        cacheEntryPath(cache, shardIdx, entry->fileId, path, CACHE_PATH_L);
+        remove(path);
+    }
+    freeBuffers(entry->outputs, entry->numOfOutputs);
+    free(entry);
+}
+
+void queueCacheSpill(CacheShard* shard, CacheEntry* entry, CacheEntry** spills)
+{
+    entry->spilling = true;
+    entry->fileId = shard->nextFileId++;
+    entry->lruNext = *spills;
+    *spills = entry;
+}
+
+bool spillCacheEntry(ImageCache* cache, size_t shardIdx, CacheEntry* entry)
+{
+    if (!cache->diskDir || entry->size > cache->shardDiskBudget)
+    {
+        return false;
+    }
+
+    char path[CACHE_PATH_L];
+    cacheEntryPath(cache, shardIdx, entry->fileId, path, CACHE_PATH_L);
+    FILE* fp = fopen(path, "wb");
+    if (!fp)
+    {
+        printf("failed to open cache file for writing\n");
+        return false;
+    }
+
+    /*
+     * the key leads the file so a load can tell it is reading the entry it expects
+     */
+    bool written = fwrite(&entry->key, sizeof(CacheKey), 1, fp) == 1 &&
+        fwrite(&entry->numOfOutputs, sizeof(int), 1, fp) == 1;
+    int i;
+    for (i = 0; i < entry->numOfOutputs && written; ++i)
+    {
+        Buffer* output = &entry->outputs[i];
+        written = fwrite(&output->size, sizeof(size_t), 1, fp) == 1 &&
+            fwrite(output->buf, sizeof(byte), output->size, fp) == output->size;
+    }
+    if (fclose(fp) != 0)
+    {
+        written = false;
+    }
+    if (!written)
+    {
+        printf("failed to write cache file\n");
+        remove(path);
+    }
+    return written;
+}
+
+bool loadCacheEntry(ImageCache* cache, size_t shardIdx, const CacheEntry* entry, Buffer** outputs)
+{
+    char path[CACHE_PATH_L];
+    cacheEntryPath(cache, shardIdx, entry->fileId, path, CACHE_PATH_L);
+    FILE* fp = fopen(path, "rb");
+    if (!fp)
+    {
+        printf("failed to open cache file for reading\n");
+        return false;
+    }
+
+    CacheKey fileKey;
+    int numOfOutputs;
+    bool loaded = fread(&fileKey, sizeof(CacheKey), 1, fp) == 1 &&
+        fread(&numOfOutputs, sizeof(int), 1, fp) == 1 &&
+        sameCacheKey(&fileKey, &entry->key) && numOfOutputs == entry->numOfOutputs;
+    Buffer* loadedOutputs = NULL;
+    if (loaded)
+    {
+        loadedOutputs = (Buffer*)calloc(entry->numOfOutputs, sizeof(Buffer));
+        loaded = loadedOutputs != NULL;
+    }
+    int i;
+    for (i = 0; i < entry->numOfOutputs && loaded; ++i)
+    {
+        Buffer* output = &loadedOutputs[i];
+        loaded = fread(&output->size, sizeof(size_t), 1, fp) == 1;
+        if (loaded)
+        {
+            output->buf = (byte*)malloc(sizeof(byte) * output->size);
+            loaded = (output->buf || !output->size) &&
+                fread(output->buf, sizeof(byte), output->size, fp) == output->size;
+        }
+    }
+    fclose(fp);
+
+    if (!loaded)
+    {
+        printf("failed to read cache file\n");
+        freeBuffers(loadedOutputs, entry->numOfOutputs);
+        return false;
+    }
+    *outputs = loadedOutputs;
+    return true;
+}
+
+void evictCacheShard(ImageCache* cache, CacheShard* shard, CacheEntry** spills, CacheEntry** drops)
+{
+    while (shard->memUsed > cache->shardMemoryBudget && shard->memTail)
+    {
+        CacheEntry* victim = shard->memTail;
+        if (!cache->diskDir || victim->size > cache->shardDiskBudget)
+        {
+            detachCacheEntry(shard, victim);
+            victim->lruNext = *drops;
+            *drops = victim;
+            continue;
+        }
+        unlinkCacheLru(&shard->memHead, &shard->memTail, victim);
+        shard->memUsed -= victim->size;
+        queueCacheSpill(shard, victim, spills);
+    }
+    while (shard->diskUsed > cache->shardDiskBudget && shard->diskTail)
+    {
+        CacheEntry* victim = shard->diskTail;
+        detachCacheEntry(shard, victim);
+        victim->lruNext = *drops;
+        *drops = victim;
+    }
+}
+
+void settleCacheShard(ImageCache* cache, CacheShard* shard, size_t shardIdx, CacheEntry* spills, CacheEntry* drops)
+{
+    while (spills || drops)
+    {
+        while (drops)
+        {
+            CacheEntry* entry = drops;
+            drops = entry->lruNext;
+            destroyCacheEntry(cache, shardIdx, entry);
+        }
+        if (!spills)
+        {
+            break;
+        }
+
+        /*
+         * the entry keeps serving lookups from memory while its file is written
+         */
+        CacheEntry* entry = spills;
+        spills = entry->lruNext;
+        entry->lruNext = NULL;
+        bool written = spillCacheEntry(cache, shardIdx, entry);
+
+        lockMutex(&shard->lock);
+        if (written)
+        {
+            freeBuffers(entry->outputs, entry->numOfOutputs);
+            entry->outputs = NULL;
+            entry->spilling = false;
+            entry->onDisk = true;
+            pushCacheLru(&shard->diskHead, &shard->diskTail, entry);
+            shard->diskUsed += entry->size;
+        }
+        else
+        {
+            detachCacheEntry(shard, entry);
+            entry->spilling = false;
+            entry->lruNext = drops;
+            drops = entry;
+        }
+        evictCacheShard(cache, shard, &spills, &drops);
+        unlockMutex(&shard->lock);
+    }
+}
+
+bool lookupImageCache(ImageCache* cache, const CacheKey* key, Buffer** outputs, int* numOfOutputs)
+{
+    size_t bucket;
+    size_t shardIdx = cacheKeySlot(key, &bucket);
+    CacheShard* shard = &cache->shards[shardIdx];
+    CacheEntry* spills = NULL, * drops = NULL;
+    bool found;
+
+    lockMutex(&shard->lock);
+    CacheEntry* entry = findCacheEntry(shard, key, bucket);
+    if (!entry)
+    {
+        unlockMutex(&shard->lock);
+        return false;
+    }
+    if (!entry->onDisk)
+    {
+        found = copyBuffers(entry->outputs, entry->numOfOutputs, outputs);
+        *numOfOutputs = entry->numOfOutputs;
+        if (!entry->spilling)
+        {
+            unlinkCacheLru(&shard->memHead, &shard->memTail, entry);
+            pushCacheLru(&shard->memHead, &shard->memTail, entry);
+        }
+        unlockMutex(&shard->lock);
+        return found;
+    }
+
+    /*
+     * the spilled entry is pinned (and taken off the disk LRU) while its file is read
+     * without the lock, the last reader to unpin it settles where it goes next
+     */
+    if (entry->pins++ == 0)
+    {
+        unlinkCacheLru(&shard->diskHead, &shard->diskTail, entry);
+    }
+    unlockMutex(&shard->lock);
+
+    int count = entry->numOfOutputs;
+    Buffer* loaded = NULL, * promoted = NULL;
+    found = loadCacheEntry(cache, shardIdx, entry, &loaded);
+    if (found && entry->size <= cache->shardMemoryBudget && !copyBuffers(loaded, count, &promoted))
+    {
+        promoted = NULL;
+    }
+
+    bool removeFile = false;
+    unsigned long fileId = entry->fileId;
+    lockMutex(&shard->lock);
+    entry->stale = entry->stale || !found;
+    if (--entry->pins == 0)
+    {
+        pushCacheLru(&shard->diskHead, &shard->diskTail, entry);
+        if (entry->stale)
+        {
+            detachCacheEntry(shard, entry);
+            entry->lruNext = drops;
+            drops = entry;
+        }
+        else if (promoted)
+        {
+            /*
+             * promote the spilled entry back to the memory tier, its file is no longer needed
+             */
+            unlinkCacheLru(&shard->diskHead, &shard->diskTail, entry);
+            shard->diskUsed -= entry->size;
+            entry->onDisk = false;
+            entry->outputs = promoted;
+            promoted = NULL;
+            removeFile = true;
+            pushCacheLru(&shard->memHead, &shard->memTail, entry);
+            shard->memUsed += entry->size;
+            evictCacheShard(cache, shard, &spills, &drops);
+        }
+    }
+    unlockMutex(&shard->lock);
+
+    if (removeFile)
+    {
+        char path[CACHE_PATH_L];
+        cacheEntryPath(cache, shardIdx, fileId, path, CACHE_PATH_L);
+        remove(path);
+    }
+    freeBuffers(promoted, count);
+    settleCacheShard(cache, shard, shardIdx, spills, drops);
+
+    if (found)
+    {
+        *outputs = loaded;
+        *numOfOutputs = count;
+    }
+    return found;
+}
+
+void insertImageCache(ImageCache* cache, const CacheKey* key, const Buffer* outputs, int numOfOutputs)
+{
+    size_t size = 0;
+    int i;
+    for (i = 0; i < numOfOutputs; ++i)
+    {
+        size += outputs[i].size;
+    }
+    if (size > cache->shardMemoryBudget && size > cache->shardDiskBudget)
+    {
+        return;
+    }
+
+    /*
+     * the copy is made before taking the lock so the shard is held only for the bookkeeping
+     */
+    CacheEntry* entry = (CacheEntry*)calloc(1, sizeof(CacheEntry));
+    if (!entry)
+    {
+        printf("allocation for cache entry failed\n");
+        return;
+    }
+    if (!copyBuffers(outputs, numOfOutputs, &entry->outputs))
+    {
+        free(entry);
+        return;
+    }
+    entry->key = *key;
+    entry->numOfOutputs = numOfOutputs;
+    entry->size = size;
+
+    size_t bucket;
+    size_t shardIdx = cacheKeySlot(key, &bucket);
+    CacheShard* shard = &cache->shards[shardIdx];
+    CacheEntry* spills = NULL, * drops = NULL;
+
+    lockMutex(&shard->lock);
+    if (findCacheEntry(shard, key, bucket))
+    {
+        /*
+         * another worker stored the same result while this one was computing it
+         */
+        unlockMutex(&shard->lock);
+        freeBuffers(entry->outputs, entry->numOfOutputs);
+        free(entry);
+        return;
+    }
+
+    entry->chainNext = shard->buckets[bucket];
+    shard->buckets[bucket] = entry;
+    if (size > cache->shardMemoryBudget)
+    {
+        queueCacheSpill(shard, entry, &spills);
+    }
+    else
+    {
+        pushCacheLru(&shard->memHead, &shard->memTail, entry);
+        shard->memUsed += size;
+    }
+    evictCacheShard(cache, shard, &spills, &drops);
+    unlockMutex(&shard->lock);
+
+    settleCacheShard(cache, shard, shardIdx, spills, drops);
+}
+
+bool cachedAverageImage(ImageCache* cache, byte* inBuffer, size_t inSize, int avgDim,
+    const char* format, Buffer* retBuffer)
+{
+    return cachedAverageImageWithMode(cache, inBuffer, inSize, avgDim, AverageBox, format, retBuffer);
+}
+
+bool cachedAverageImageWithMode(ImageCache* cache, byte* inBuffer, size_t inSize, int avgDim,
+    enum averageMode mode, const char* format, Buffer* retBuffer)
+{
+    if (!cache || !inBuffer || avgDim <= 0)
+    {
+        return false;
+    }
+
+    CacheKey key;
+    if (!makeCacheKey(inBuffer, inSize, CacheAverage, avgDim, mode, format, &key))
+    {
+        return false;
+    }
+
+    Buffer* cached;
+    int numOfCached;
+    if (lookupImageCache(cache, &key, &cached, &numOfCached))
+    {
+        *retBuffer = cached[0];
+        free(cached);
+        return true;
+    }
+
+    Image* image;
+    if (!openImageSized(inBuffer, inSize, &image))
+    {
+        return false;
+    }
+    if (!averageImageWithMode(avgDim, mode, image))
+    {
+        freeImage(image);
+        return false;
+    }
+    Buffer encoded = { NULL, 0 };
+    if (!saveImageToBuffer(image, format, &encoded))
+    {
+        freeImage(image);
+        return false;
+    }
 
-            newRowsList[chunkOffest] = newRows;
-            size_t y_offest = outerY * newHeight;
-            size_t x_offest = outerX * newWidth * 4;
-            for (y = 0; y < newHeight; ++y)
-            {
-                byte* row = rows[y + y_offest];
-                byte* newRow = (byte*)malloc(sizeof(byte) * newWidth * 4);
-                if (!newRow)
-                {
-                    printf("allocation for chunked image list failed\n");
-                    freeRows(newRows, y);
-                    int i;
-                    for (i = 0; i < chunkOffest - 1; ++i)
-                    {
-                        freeRows(newRowsList[i], newHeight);
-                    }
-                    return false;
-                }
+    insertImageCache(cache, &key, &encoded, 1);
+    *retBuffer = encoded;
+    return true;
+}
 
-                newRows[y] = newRow;
-                for (x = 0; x < newWidth; ++x)
-                {
-                    unsigned int pos = x * 4;
-                    newRow[pos] = row[pos + x_offest];
-                    newRow[pos + 1] = row[pos + x_offest + 1];
-                    newRow[pos + 2] = row[pos + x_offest + 2];
-                    newRow[pos + 3] = row[pos + x_offest + 3];
-                }
-            }
-        }
+bool cachedPaveImage(ImageCache* cache, byte* inBuffer, size_t inSize, int numOfImgs,
+    const char* format, Buffer** retBuffers)
+{
+    if (!cache || !inBuffer || numOfImgs <= 0)
+    {
+        return false;
     }
 
-    Image** images = (Image**)malloc(sizeof(Image*) * size);
+    CacheKey key;
+    if (!makeCacheKey(inBuffer, inSize, CachePave, numOfImgs, AverageBox, format, &key))
+    {
+        return false;
+    }
 
-    for (i = 0; i < size; ++i)
+    int numOfCached;
+    if (lookupImageCache(cache, &key, retBuffers, &numOfCached))
     {
-        images[i] = (Image*)malloc(sizeof(Image));
-        images[i]->height = newHeight;
-        images[i]->width = newWidth;
-        images[i]->bitDepth = image->bitDepth;
-        images[i]->colorTypeVal = image->colorTypeVal;
-        images[i]->colorTypeEnum = image->colorTypeEnum;
-        images[i]->rowPtrs = newRowsList[i];
+        return true;
     }
 
-    *imageChunks = images;
+    Image* image, ** chunks;
+    if (!openImageSized(inBuffer, inSize, &image))
+    {
+        return false;
+    }
+    bool paved = paveImage(numOfImgs, image, &chunks);
+    freeImage(image);
+    if (!paved)
+    {
+        return false;
+    }
+
+    int i, size = numOfImgs * numOfImgs;
+    Buffer* encoded = (Buffer*)calloc(size, sizeof(Buffer));
+    if (!encoded)
+    {
+        printf("allocation for encoded chunks failed\n");
+        for (i = 0; i < size; ++i)
+        {
+            freeImage(chunks[i]);
+        }
+        free(chunks);
+        return false;
+    }
+
+    /*
+     * saveImageToBuffer releases each chunk on success, the rest are released here on failure
+     */
+    for (i = 0; i < size; ++i)
+    {
+        if (!saveImageToBuffer(chunks[i], format, &encoded[i]))
+        {
+            for (; i < size; ++i)
+            {
+                freeImage(chunks[i]);
+            }
+            free(chunks);
+            freeBuffers(encoded, size);
+            return false;
+        }
+    }
+    free(chunks);
 
+    insertImageCache(cache, &key, encoded, size);
+    *retBuffers = encoded;
     return true;
 }
 
@@ -531,13 +3386,444 @@ void writePngToFile(Image* image, char* fileName)
     fclose(fp);
 }
 
+/*
+* the harnesses below exercise the error paths of open/save/average/pave that the QA main
+* never reaches: truncated and corrupted input, non-divisible dimensions and chunk/average
+* sizes larger than the image
+*/
+
+bool readFileToBuffer(const char* fileName, Buffer* contents)
+{
+    FILE* fp = fopen(fileName, "rb");
+    if (!fp)
+    {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long flen = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (flen <= 0)
+    {
+        fclose(fp);
+        return false;
+    }
+
+    contents->buf = (byte*)malloc(flen);
+    contents->size = contents->buf ? fread(contents->buf, sizeof(byte), flen, fp) : 0;
+    fclose(fp);
+    if (contents->size != (size_t)flen)
+    {
+        free(contents->buf);
+        return false;
+    }
+    return true;
+}
+
+bool sameImage(const Image* a, const Image* b)
+{
+    if (a->width != b->width || a->height != b->height || a->bitDepth != b->bitDepth ||
+        a->colorTypeVal != b->colorTypeVal)
+    {
+        return false;
+    }
+    size_t y, rowBytes = imageRowBytes(a, a->width);
+    for (y = 0; y < a->height; ++y)
+    {
+        if (memcmp(a->rowPtrs[y], b->rowPtrs[y], rowBytes))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * one iteration of the benchmark, the same chain of calls as the QA main:
+ * open -> save -> open -> average -> save -> open -> pave (the last two for 8-bit RGBA only)
+ */
+bool benchRoundTrip(Buffer* input)
+{
+    Image* image, ** chunks;
+    Buffer encoded = { NULL, 0 };
+    if (!openImageSized(input->buf, input->size, &image))
+    {
+        return false;
+    }
+    bool isEightBitRgba = image->colorTypeEnum == RGBA && image->bitDepth == 8;
+    if (!saveImageToBuffer(image, PNG, &encoded))
+    {
+        freeImage(image);
+        return false;
+    }
+    if (!openImageSized(encoded.buf, encoded.size, &image))
+    {
+        free(encoded.buf);
+        return false;
+    }
+    free(encoded.buf);
+    if (!isEightBitRgba)
+    {
+        freeImage(image);
+        return true;
+    }
+
+    int dim = image->width < 4 || image->height < 4 ? 1 : 4;
+    if (!averageImage(dim, image) || !saveImageToBuffer(image, PNG, &encoded))
+    {
+        freeImage(image);
+        return false;
+    }
+    bool success = openImageSized(encoded.buf, encoded.size, &image);
+    free(encoded.buf);
+    if (!success)
+    {
+        return false;
+    }
+    success = paveImage(dim, image, &chunks);
+    freeImage(image);
+    if (success)
+    {
+        int i;
+        for (i = 0; i < dim * dim; ++i)
+        {
+            freeImage(chunks[i]);
+        }
+        free(chunks);
+    }
+    return success;
+}
+
+/*
+ * one pass of the benchmark over a corpus file, repeats benchRoundTrip until 'seconds' of cpu
+ * time are used up (at least once) and keeps the cpu time per iteration if it is the best
+ * pass so far. the iterations are timed together, so coarse process clocks still work
+ */
+bool benchCorpusFile(BenchFile* file, double seconds)
+{
+    long iterations = 0;
+    double start = processCpuSeconds(), elapsed;
+    do
+    {
+        if (!benchRoundTrip(&file->input))
+        {
+            return false;
+        }
+        ++iterations;
+        elapsed = processCpuSeconds() - start;
+    } while (elapsed < seconds);
+
+    double perIteration = elapsed / iterations;
+    if (!file->bestSeconds || perIteration < file->bestSeconds)
+    {
+        file->bestSeconds = perIteration;
+    }
+    return true;
+}
+
+/*
+ * the baseline is a text file with a "<corpus file> <megapixels per second>" line per entry
+ */
+bool readBaseline(const char* baselineFile, const char* name, double* throughput)
+{
+    FILE* fp = fopen(baselineFile, "r");
+    if (!fp)
+    {
+        return false;
+    }
+    char entry[CACHE_PATH_L];
+    double value;
+    bool found = false;
+    while (!found && fscanf(fp, "%1023s %lf", entry, &value) == 2)
+    {
+        found = !strcmp(entry, name);
+    }
+    fclose(fp);
+    if (found)
+    {
+        *throughput = value;
+    }
+    return found;
+}
+
+/*
+ * LibImage --bench <baseline> [--record] [--threshold <percent>] [--budget <seconds>] <corpus file>...
+ * measures every corpus file (a fuzz corpus works as is, inputs that don't decode are skipped)
+ * and --record writes the measurements as the new baseline. the corpus is loaded up front and
+ * gone through BENCH_PASSES times, so the passes of every file are spread over the whole
+ * budget and each file keeps its best one. single files are only reported, small inputs are too noisy
+ * to gate on. the files that have a baseline entry are compared as a whole, ret val is
+ * non-zero when they regressed by more than the threshold. files missing from the baseline
+ * are reported and left out
+ */
+int runBenchmark(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        printf("usage: --bench <baseline> [--record] [--threshold <percent>] [--budget <seconds>] <corpus file>...\n");
+        return -1;
+    }
+
+    const char* baselineFile = argv[0];
+    bool record = false;
+    double threshold = BENCH_THRESHOLD_PERCENT, budget = BENCH_BUDGET_SECONDS;
+    int i = 1;
+    for (; i < argc && !strncmp(argv[i], "--", 2); ++i)
+    {
+        if (!strcmp(argv[i], "--record"))
+        {
+            record = true;
+        }
+        else if (!strcmp(argv[i], "--threshold") && i + 1 < argc)
+        {
+            threshold = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--budget") && i + 1 < argc)
+        {
+            budget = atof(argv[++i]);
+        }
+        else
+        {
+            printf("unknown benchmark option %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (i == argc)
+    {
+        printf("no corpus files given\n");
+        return -1;
+    }
+
+    FILE* out = NULL;
+    if (record)
+    {
+        out = fopen(baselineFile, "w");
+        if (!out)
+        {
+            printf("cannot write baseline %s\n", baselineFile);
+            return -1;
+        }
+    }
+
+    BenchFile* files = (BenchFile*)calloc(argc - i, sizeof(BenchFile));
+    if (!files)
+    {
+        printf("allocation for the corpus failed\n");
+        if (out)
+        {
+            fclose(out);
+        }
+        return -1;
+    }
+    int numOfFiles = 0;
+    for (; i < argc; ++i)
+    {
+        BenchFile* file = &files[numOfFiles];
+        file->name = argv[i];
+        if (!readFileToBuffer(argv[i], &file->input))
+        {
+            printf("%s: unreadable, skipped\n", argv[i]);
+            continue;
+        }
+        Image* image;
+        if (!openImageSized(file->input.buf, file->input.size, &image))
+        {
+            printf("%s: not decodable, skipped\n", argv[i]);
+            free(file->input.buf);
+            continue;
+        }
+        file->pixels = (double)image->width * image->height;
+        freeImage(image);
+        ++numOfFiles;
+    }
+
+    int pass, f;
+    double passSeconds = numOfFiles ? budget / BENCH_PASSES / numOfFiles : 0;
+    for (pass = 0; pass < BENCH_PASSES; ++pass)
+    {
+        for (f = 0; f < numOfFiles; ++f)
+        {
+            if (files[f].pixels && !benchCorpusFile(&files[f], passSeconds))
+            {
+                printf("%s: round trip failed, skipped\n", files[f].name);
+                files[f].pixels = 0;
+            }
+        }
+    }
+
+    /*
+     * the compared files are summed up as the time the baseline would take for them
+     * against the time they took now
+     */
+    double measuredSeconds = 0, baselineSeconds = 0;
+    int measured = 0, compared = 0, missing = 0;
+    for (f = 0; f < numOfFiles; ++f)
+    {
+        BenchFile* file = &files[f];
+        free(file->input.buf);
+        if (!file->pixels)
+        {
+            continue;
+        }
+        ++measured;
+
+        double throughput = file->pixels / file->bestSeconds / 1e6;
+        if (out)
+        {
+            fprintf(out, "%s %f\n", file->name, throughput);
+            printf("%s: %.2f Mpix/s recorded\n", file->name, throughput);
+            continue;
+        }
+        double baseline;
+        if (!readBaseline(baselineFile, file->name, &baseline) || baseline <= 0)
+        {
+            printf("%s: %.2f Mpix/s, missing from the baseline\n", file->name, throughput);
+            ++missing;
+            continue;
+        }
+        printf("%s: %.2f Mpix/s, baseline %.2f (%+.1f%%)\n", file->name, throughput, baseline,
+            (throughput - baseline) / baseline * 100);
+        measuredSeconds += file->bestSeconds;
+        baselineSeconds += file->pixels / (baseline * 1e6);
+        ++compared;
+    }
+    free(files);
+
+    if (out)
+    {
+        fclose(out);
+        printf("%d files recorded\n", measured);
+        return 0;
+    }
+    bool regressed = false;
+    printf("%d files measured, %d compared, %d missing from the baseline\n", measured, compared, missing);
+    if (compared)
+    {
+        double change = (baselineSeconds / measuredSeconds - 1) * 100;
+        regressed = change < -threshold;
+        printf("corpus: %+.1f%% against the baseline%s\n", change, regressed ? " REGRESSION" : "");
+    }
+    return regressed ? 1 : 0;
+}
+
+#ifdef LIBIMAGE_FUZZ
+/*
+ * libFuzzer entry, build with -DLIBIMAGE_FUZZ (which drops main), e.g:
+ *   clang -DLIBIMAGE_FUZZ -fsanitize=fuzzer,address,undefined LibImage.c -lpng16 -lpthread -lm
+ * AFL++ runs the same entry through its libFuzzer driver (afl-clang-fast -fsanitize=fuzzer)
+ *
+ * decoded input is saved and decoded again, the two decodes have to match exactly
+ * 8-bit RGBA input is additionally paved and averaged with sizes picked from its last bytes,
+ * so sizes that don't divide the image or exceed it are covered too
+ */
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    /*
+     * IHDR is always the first chunk, huge declared dimensions only measure malloc
+     */
+    if (size >= 24)
+    {
+        size_t width = (size_t)data[16] << 24 | data[17] << 16 | data[18] << 8 | data[19];
+        size_t height = (size_t)data[20] << 24 | data[21] << 16 | data[22] << 8 | data[23];
+        if (width && height > FUZZ_MAX_PIXELS / width)
+        {
+            return 0;
+        }
+    }
+
+    byte* input = (byte*)malloc(size ? size : 1);
+    if (!input)
+    {
+        return 0;
+    }
+    memcpy(input, data, size);
+
+    Image* image, * saved, * reopened, ** chunks;
+    if (!openImageSized(input, size, &image))
+    {
+        free(input);
+        return 0;
+    }
+    if (!openImageSized(input, size, &saved))
+    {
+        abort();
+    }
+    free(input);
+
+    /*
+     * palette images are kept as indices without the palette, which png refuses to save
+     */
+    Buffer encoded = { NULL, 0 };
+    if (image->colorTypeEnum != PLTE)
+    {
+        if (!saveImageToBuffer(saved, PNG, &encoded))
+        {
+            abort();
+        }
+        if (!openImageSized(encoded.buf, encoded.size, &reopened) || !sameImage(image, reopened))
+        {
+            abort();
+        }
+        free(encoded.buf);
+        freeImage(reopened);
+    }
+    else
+    {
+        freeImage(saved);
+    }
+
+    if (image->colorTypeEnum == RGBA && image->bitDepth == 8 && size >= 2)
+    {
+        int numOfImgs = data[size - 1] % 8;
+        int avgDim = data[size - 2] % 8;
+        bool fits = numOfImgs > 0 && (size_t)numOfImgs <= image->width && (size_t)numOfImgs <= image->height;
+        if (paveImage(numOfImgs, image, &chunks) != fits)
+        {
+            abort();
+        }
+        if (fits)
+        {
+            int i;
+            for (i = 0; i < numOfImgs * numOfImgs; ++i)
+            {
+                freeImage(chunks[i]);
+            }
+            free(chunks);
+        }
+
+        fits = avgDim > 0 && (size_t)avgDim <= image->width && (size_t)avgDim <= image->height;
+        enum averageMode mode = data[size - 2] & 8 ? AverageLinear : AverageBox;
+        if (averageImageWithMode(avgDim, mode, image) != fits)
+        {
+            abort();
+        }
+        if (fits)
+        {
+            if (!saveImageToBuffer(image, PNG, &encoded))
+            {
+                abort();
+            }
+            free(encoded.buf);
+            return 0;
+        }
+    }
+    freeImage(image);
+    return 0;
+}
+#endif
+
+#ifndef LIBIMAGE_FUZZ
 int main(int argc, char* argv[])
 {
     if (argc < 2)
     {
         printf("for testing, input argument == imagename\n");
+        printf("for benchmarking, --bench <baseline> [--record] [--threshold <percent>] [--budget <seconds>] <corpus file>...\n");
         return -1;
     }
+    if (!strcmp(argv[1], "--bench"))
+    {
+        return runBenchmark(argc - 2, argv + 2);
+    }
 
     FILE* fp;
     byte* buf, * buf2, * buf3;
@@ -616,3 +3902,4 @@ int main(int argc, char* argv[])
     }
     return 0;
 }
+#endif
@@ -7,7 +7,29 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <math.h>
 #include <png.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/*
+ * SIMD paths of the layout kernels, the scalar loops are used when these are unavailable
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LIBIMAGE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__) || defined(__AVX__)
+#define LIBIMAGE_SSSE3
+#include <tmmintrin.h>
+#endif
 
 #define JPEG "JPEG"
 #define PNG "PNG"
@@ -15,6 +37,11 @@
 #define JPEG_L 4
 #define PNG_L 8
 
+/*
+ * input size used by the unsized open calls, the encoded stream itself is trusted to end in time
+ */
+#define UNBOUNDED_SIZE ((size_t)-1)
+
 /*
  * the library's external API (open,save,avg,pave) all return a boolean
  * the boolean value indicates whether the call is successful or not
@@ -76,6 +103,40 @@ typedef struct
 } Image;
 
 
+/*
+ * averaging modes, AverageBox is the plain box filter over the encoded bytes.
+ * AverageLinear averages in linear light and weights the color of each pixel by its
+ * alpha (expects straight, non-premultiplied alpha), so downscaled images don't darken
+ * and transparent pixels don't bleed their color in to the result. the sRGB bytes are
+ * linearized through a 256-entry table in to 16-bit fixed point, and converted back
+ * through a LINEAR_LUT_L-entry table indexed by the top bits of the linear value
+ */
+enum averageMode
+{
+    AverageBox, AverageLinear
+};
+
+#define LINEAR_LUT_L 4096
+#define LINEAR_LUT_STEP (65536 / LINEAR_LUT_L)
+
+
+/*
+ * target layout for decoding, LayoutNative keeps whatever layout the file has, the others
+ * convert any color-type and bit-depth to 8-bit RGBA/RGB/gray while the rows are read.
+ * premultiplied multiplies the color channels by alpha and requires LayoutRgba8
+ */
+enum pixelLayout
+{
+    LayoutNative, LayoutRgba8, LayoutRgb8, LayoutGray8
+};
+
+typedef struct
+{
+    enum pixelLayout layout;
+    bool premultiplied;
+} DecodeOptions;
+
+
 /*
  * the Buffer struct is used for read&write capabilities, in order to open the image
  * from an in-memory buffer (at least in the specific case of the png-handler), the
@@ -88,6 +149,275 @@ typedef struct
 } Buffer;
 
 
+/*
+ * thin portability layer over the platform's mutex, condition variable and thread,
+ * the cache and the executor (and anything else that has to be thread-safe) only
+ * use them through the wrappers declared at the bottom of this file
+ */
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Condition;
+typedef HANDLE Thread;
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+typedef pthread_t Thread;
+#endif
+
+#ifdef _WIN32
+typedef INIT_ONCE Once;
+#define ONCE_INIT INIT_ONCE_STATIC_INIT
+#else
+typedef pthread_once_t Once;
+#define ONCE_INIT PTHREAD_ONCE_INIT
+#endif
+
+
+/*
+ * progressive decoding, the encoded bytes are fed to the decoder as they arrive and
+ * the preview callback receives a borrowed Image (valid only during the callback):
+ * for Adam7-interlaced images after each pass except the last, with every pixel
+ * filled from the pixels known so far, and for non-interlaced images every
+ * previewRows rows, holding the rows decoded so far. the callback returns false to
+ * stop decoding, the preview it was shown can then be taken with finish
+ */
+typedef bool (*PreviewCallback)(Image* preview, int pass, void* userData);
+
+typedef struct
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    byte** rowPtrs;
+    byte** previewPtrs;
+    size_t allocatedRows;
+    size_t bytesPerPixel;
+    size_t previewRows;
+    size_t rowsDone;
+    int passes;
+    int lastPass;
+    Image image;
+    PreviewCallback callback;
+    void* userData;
+    bool failed;
+    bool stopped;
+    bool finished;
+} ProgressiveDecoder;
+
+
+/*
+ * lazy pipeline, steps are only recorded by the pipeline* functions and executed by
+ * runPipeline. crop and average steps are folded into a PipelineView over the source
+ * raster instead of being applied one after the other, pave splits the view into tiles
+ * and save encodes every tile row straight out of the view, so a pipeline such as
+ * open -> crop -> average -> pave -> save makes a single pass over the decoded source.
+ * an intermediate raster is only materialized when two averages are stacked
+ */
+#define PIPELINE_MAX_STEPS 16
+
+enum pipelineOperation
+{
+    OpOpen, OpCrop, OpAverage, OpPave, OpSave
+};
+
+typedef struct
+{
+    enum pipelineOperation operation;
+    byte* inBuffer;
+    size_t inSize;
+    DecodeOptions options;
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+    int param;
+    enum averageMode mode;
+    const char* format;
+} PipelineStep;
+
+typedef struct
+{
+    PipelineStep steps[PIPELINE_MAX_STEPS];
+    int numOfSteps;
+} Pipeline;
+
+/*
+ * region of the source raster covered by the pipeline's output (in source pixels)
+ * and the average that is still pending on it, avgDim 1 means no averaging
+ */
+typedef struct
+{
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+    int avgDim;
+    enum averageMode mode;
+} PipelineView;
+
+/*
+ * a pipeline that ends with save returns encoded buffers, otherwise it returns images
+ * numOfOutputs is 1, or numOfImgs^2 if the pipeline paves
+ */
+typedef struct
+{
+    Image** images;
+    Buffer* buffers;
+    int numOfOutputs;
+} PipelineResult;
+
+
+/*
+ * result cache for repeated average/pave requests
+ * entries are keyed by a 64-bit hash of the input buffer plus the operation
+ * parameters, and hold the already encoded outputs. the cache is split into
+ * shards, each with its own lock, hash buckets and LRU lists, so concurrent
+ * callers only contend when their keys land on the same shard.
+ * memory and disk budgets are divided evenly between the shards, entries that
+ * fall off the memory LRU are spilled to disk (when a disk budget was given)
+ * and entries that fall off the disk LRU are dropped for good
+ * the spill files are written and read without holding the shard lock, entries
+ * in the middle of it are kept off the LRU lists so eviction leaves them alone
+ */
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 64
+#define CACHE_PATH_L 1024
+
+/*
+ * xxHash64 constants, used by hashBuffer
+ */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+enum cacheOperation
+{
+    CacheAverage, CachePave
+};
+
+typedef struct
+{
+    uint64_t inputHash;
+    size_t inputSize;
+    enum cacheOperation operation;
+    int param;
+    enum averageMode mode;
+    enum format saveFormat;
+} CacheKey;
+
+typedef struct CacheEntry
+{
+    CacheKey key;
+    Buffer* outputs;
+    int numOfOutputs;
+    size_t size;
+    bool onDisk;
+    bool spilling;
+    bool stale;
+    int pins;
+    unsigned long fileId;
+    struct CacheEntry* chainNext;
+    struct CacheEntry* lruPrev;
+    struct CacheEntry* lruNext;
+} CacheEntry;
+
+typedef struct
+{
+    Mutex lock;
+    CacheEntry* buckets[CACHE_BUCKETS];
+    CacheEntry* memHead;
+    CacheEntry* memTail;
+    CacheEntry* diskHead;
+    CacheEntry* diskTail;
+    size_t memUsed;
+    size_t diskUsed;
+    unsigned long nextFileId;
+} CacheShard;
+
+typedef struct
+{
+    CacheShard shards[CACHE_SHARDS];
+    size_t shardMemoryBudget;
+    size_t shardDiskBudget;
+    char* diskDir;
+    unsigned long processId;
+    unsigned long instanceId;
+} ImageCache;
+
+
+/*
+ * asynchronous jobs, the *Async functions queue a job on an executor and return its
+ * handle right away. workers pick the pending job with the highest priority (FIFO
+ * within the same priority). decode, average and encode check for cancellation
+ * between bands of JOB_BAND_ROWS rows, so cancelling an in-flight job stops it
+ * within a band rather than at the end of the whole image
+ */
+#define JOB_BAND_ROWS 16
+
+enum jobOperation
+{
+    JobOpen, JobAverage, JobSave
+};
+
+enum jobPriority
+{
+    PriorityBulk, PriorityNormal, PriorityInteractive
+};
+
+enum jobState
+{
+    JobPending, JobRunning, JobDone, JobFailed, JobCancelled
+};
+
+struct ImageJob;
+typedef void (*JobCallback)(struct ImageJob* job, void* userData);
+
+/*
+ * the result of a finished job is in 'image' (open/average) or in 'buffer' (save)
+ * average works on the given image in place and save consumes it, just like their
+ * blocking counterparts. the callback runs once the job has finished and before
+ * waitImageJob returns (on the worker thread, or on the cancelling thread for a job
+ * cancelled while still queued), it must not free the job
+ */
+struct ImageExecutor;
+
+typedef struct ImageJob
+{
+    enum jobOperation operation;
+    enum jobPriority priority;
+    byte* inBuffer;
+    size_t inSize;
+    DecodeOptions options;
+    Image* image;
+    int avgDim;
+    enum averageMode mode;
+    const char* format;
+    Buffer buffer;
+    JobCallback callback;
+    void* userData;
+    enum jobState state;
+    bool cancelled;
+    bool finished;
+    bool detached;
+    Mutex lock;
+    Condition done;
+    struct ImageExecutor* executor;
+    struct ImageJob* next;
+} ImageJob;
+
+typedef struct ImageExecutor
+{
+    Mutex lock;
+    Condition available;
+    ImageJob* queue;
+    Thread* threads;
+    int numOfThreads;
+    bool stopping;
+} ImageExecutor;
+
+
 /*
  * receives a byte array and a ptr to image ptr, verifies the format
  * is supported and redirects it to the relevant format-open-handler
@@ -96,14 +426,33 @@ typedef struct
  */
 bool openImage(byte* buf, Image** image);
 
+/*
+ * same as openImage, reading never goes past the first 'size' bytes of buf
+ * truncated or corrupted input fails cleanly, use it for untrusted data
+ */
+bool openImageSized(byte* buf, size_t size, Image** image);
+
+/*
+ * same as openImageSized, with the decoded rows converted to the layout requested in
+ * options. a NULL options (or LayoutNative) behaves exactly like openImageSized
+ */
+bool openImageWithOptions(byte* buf, size_t size, const DecodeOptions* options, Image** image);
+
 /*
  * receives an image ptr, format string and a ptr to a ptr of byte array, verifies the
  * save format is supported and redirects it to the relevant format-save-handler
  * ret val is indicaction of success, in case of success retBuffer will reference the
  * address of the byte array that is the binary representation of the Image argument
+ * the image is released on success only, in case of failure it is still owned by the caller
  */
 bool saveImage(Image* image, const char* format, byte** retBuffer);
 
+/*
+ * same as saveImage, but the encoded result is returned as a Buffer so the
+ * caller also gets the size of the binary representation
+ */
+bool saveImageToBuffer(Image* image, const char* format, Buffer* retBuffer);
+
 /*
  * receives an image ptr and the requested dimension to be used for the average calculation
  * in case of allocation failures the state of the image ptr is unaltered and ret val is false
@@ -111,6 +460,11 @@ bool saveImage(Image* image, const char* format, byte** retBuffer);
  */
 bool averageImage(int avgDim, Image* image);
 
+/*
+ * same as averageImage, using the requested averaging mode (averageImage is AverageBox)
+ */
+bool averageImageWithMode(int avgDim, enum averageMode mode, Image* image);
+
 /*
  * receives an image ptr, the requested num of images to split the image in-to
  * and the ptr to the (not-yet-allocated and-) soon to be array of chunked images
@@ -122,13 +476,31 @@ bool averageImage(int avgDim, Image* image);
  */
 bool paveImage(int numOfImgs, Image* image, Image*** imageChunks);
 
+/*
+ * cancellable counterparts of open/save/average, used by the executor's workers
+ * the external API calls them with a NULL job, which is never cancelled
+ */
+bool openImageJob(byte* buf, size_t size, const DecodeOptions* options, Image** image, ImageJob* job);
+bool saveImageJob(Image* image, const char* format, Buffer* retBuffer, ImageJob* job);
+bool averageImageJob(int avgDim, enum averageMode mode, Image* image, ImageJob* job);
+
 
 /*
  * specific handlers for parsing the matrix of image data with 8-bit depth and RGBA channels
  * an expandle solution, new handlers will be able to support more bit-depth and color-types
  */
 bool handleEightBitRgbaPaving(Image* image, int numOfImgs, Image*** imageChunks);
-bool handleEightBitRgbaAveraging(Image* image, int avgDim);
+bool handleEightBitRgbaAveraging(Image* image, int avgDim, ImageJob* job);
+bool handleEightBitRgbaLinearAveraging(Image* image, int avgDim, ImageJob* job);
+
+/*
+ * helpers of the linear averaging. accumulateLinearRow linearizes a row, weights it by
+ * alpha and adds every avgDim pixels to the sums of their output pixel, resolveLinearRow
+ * turns the sums of a band in to an output row
+ */
+void initLinearLuts(void);
+void accumulateLinearRow(const byte* row, uint64_t* blockSums, size_t newWidth, int avgDim);
+void resolveLinearRow(const uint64_t* blockSums, byte* newRow, size_t newWidth, int avgDim);
 
 /*
  * helper function for calculating the average value for the given dimension.
@@ -143,12 +515,13 @@ void calcAverage(byte** rows, int avgDim, size_t start_x, size_t start_y, int* a
  * creates and allocates the memory for the averaged binary matrix that represents the averaged image
  * in case of success, the matrix is to be returned. in case of failure, return value is NULL
  */
-byte** createAvgImage(byte** rows, size_t newHeight, size_t newWidth, int numOfImgs);
+byte** createAvgImage(byte** rows, size_t newHeight, size_t newWidth, int numOfImgs, ImageJob* job);
 
 
 /*
  * this following 2 procedures override the default I/O procedures for the libpng library
  * this is done to allow libpng's API to use my provided buffers instead of the default file stream
+ * on reads the Buffer's size is the number of bytes left, reading past it raises a png error
  */
 void readFromBuffer(png_structp png_ptr, png_bytep dataBuffer, png_size_t bytesToRead);
 void writeToBuffer(png_structp png_ptr, png_bytep dataBuffer, png_size_t bytesToRead);
@@ -158,17 +531,52 @@ void writeToBuffer(png_structp png_ptr, png_bytep dataBuffer, png_size_t bytesTo
  * specific type handlers that are called from their generic external counterparts
  * in the case of addition of future formats, each format will receive its own handler
  */
-bool handleOpenPng(byte* buf, Image** image);
-bool handleSavePng(Image* image, byte** buf);
+bool handleOpenPng(byte* buf, size_t size, const DecodeOptions* options, Image** image, ImageJob* job);
+bool handleSavePng(Image* image, Buffer* buf, ImageJob* job);
 /* bool handleOpenJpeg(const byte* buf, Image** image);
  * bool handleSaveJpeg(Image* image, byte** buf);
  */
 
 
+/*
+ * reads the remaining rows of the png in bands, converting each band to the requested layout
+ * helper for handleOpenPng, libpng's transforms are expected to be set up (sub-byte unpacking)
+ */
+bool readPngRowsConverted(png_structp png_ptr, png_infop info_ptr, const DecodeOptions* options,
+    byte fileBitDepth, int passes, byte** rowPtrs, ImageJob* job);
+void buildPaletteLut(png_structp png_ptr, png_infop info_ptr, byte* lut);
+bool buildColorKey(png_structp png_ptr, png_infop info_ptr, byte fileBitDepth, byte* key);
+void convertRowLayout(const byte* src, int channels, const byte* paletteLut, const byte* colorKey,
+    const DecodeOptions* options, byte* rgbaRow, byte* dst, size_t width);
+int layoutChannels(enum pixelLayout layout);
+byte layoutColorType(enum pixelLayout layout);
+
+/*
+ * ret val is false (and the reason printed) for a layout outside enum pixelLayout or
+ * premultiplied alpha without LayoutRgba8, a NULL options is valid
+ */
+bool checkDecodeOptions(const DecodeOptions* options);
+
+/*
+ * layout kernels, width is in pixels (samples for sixteenToEightBit, which may run in place)
+ */
+void sixteenToEightBit(const byte* src, byte* dst, size_t samples);
+void paletteToRgba(const byte* src, const byte* lut, byte* dst, size_t width);
+void grayToRgba(const byte* src, byte* dst, size_t width);
+void grayKeyToRgba(const byte* src, byte key, byte* dst, size_t width);
+void grayAlphaToRgba(const byte* src, byte* dst, size_t width);
+void rgbToRgba(const byte* src, byte* dst, size_t width);
+void rgbKeyToRgba(const byte* src, const byte* key, byte* dst, size_t width);
+void rgbaToRgb(const byte* src, byte* dst, size_t width);
+void rgbaToGray(const byte* src, byte* dst, size_t width);
+void premultiplyRgba(byte* pixels, size_t width);
+
+
 /*
  * helper function for freeing allocated image data
  */
 void freeRows(byte** rowPtrs, size_t height);
+void freeImage(Image* image);
 
 
 /*
@@ -183,7 +591,7 @@ bool isFormatMatch(const byte* buf, const byte* format, int formatLen);
  * returns an enum representation of the buffer's format
  * enum value 'None' is returned if it is not supported
  */
-enum format isFormatSupported(const byte* buf);
+enum format isFormatSupported(const byte* buf, size_t size);
 
 /*
  * verifies the requested save format in saveImage is supported (case-insensitive to *INPUT*)
@@ -200,3 +608,301 @@ bool formatCompIgnoreCase(const char* s1, const char* s2);
  * its own dictionary for translation of color-type
  */
 enum colorType pngColorTypeDictionary(byte colorType);
+
+
+/*
+ * translates the requested save format string to its format enum
+ * enum value 'None' is returned if the save format is not supported
+ */
+enum format saveFormatDictionary(const char* format);
+
+
+/*
+ * creates a progressive png decoder, previewRows is the number of rows between the
+ * previews of a non-interlaced image (0 for none). ret val is NULL in case of failure
+ */
+ProgressiveDecoder* createProgressiveDecoder(size_t previewRows, PreviewCallback callback, void* userData);
+void freeProgressiveDecoder(ProgressiveDecoder* decoder);
+
+/*
+ * feeds the next chunk of the encoded image, previews are emitted from within this call
+ * ret val is false if the data is corrupted or the callback stopped the decoding
+ */
+bool feedProgressiveDecoder(ProgressiveDecoder* decoder, byte* data, size_t size);
+
+/*
+ * in case of success 'image' is allocated with the decoded image, or with the last preview
+ * if the callback stopped the decoding. ret val is false while the image is incomplete
+ */
+bool finishProgressiveDecoder(ProgressiveDecoder* decoder, Image** image);
+
+/*
+ * libpng's progressive reader callbacks and the preview helpers
+ */
+void progressiveInfo(png_structp png_ptr, png_infop info_ptr);
+void progressiveRow(png_structp png_ptr, png_bytep newRow, png_uint_32 rowNum, int pass);
+void progressiveEnd(png_structp png_ptr, png_infop info_ptr);
+void emitAdam7Preview(ProgressiveDecoder* decoder, int pass);
+void emitProgressivePreview(ProgressiveDecoder* decoder, size_t height, int pass);
+void fillAdam7Preview(byte** rows, byte** previewRows, size_t width, size_t height, size_t bytesPerPixel, int pass);
+
+/*
+ * creates an empty pipeline, ret val is NULL in case of allocation failure
+ */
+Pipeline* createPipeline(void);
+void freePipeline(Pipeline* pipeline);
+
+/*
+ * step recorders, each returns false if the pipeline is already full (or the arguments are
+ * invalid). open must be the first step, it decodes like openImageWithOptions (inBuffer has
+ * to stay valid until runPipeline, options is copied and may be NULL). crop coordinates are
+ * in the pipeline's current output pixels, only save may follow pave and save is last
+ */
+bool pipelineOpen(Pipeline* pipeline, byte* inBuffer, size_t inSize, const DecodeOptions* options);
+bool pipelineCrop(Pipeline* pipeline, size_t x, size_t y, size_t width, size_t height);
+bool pipelineAverage(Pipeline* pipeline, int avgDim);
+bool pipelineAverageWithMode(Pipeline* pipeline, int avgDim, enum averageMode mode);
+bool pipelinePave(Pipeline* pipeline, int numOfImgs);
+bool pipelineSave(Pipeline* pipeline, const char* format);
+bool addPipelineStep(Pipeline* pipeline, const PipelineStep* step);
+
+/*
+ * executes the recorded steps. image is the source when the pipeline doesn't start with
+ * open, it is only read and stays owned by the caller. in case of success result holds
+ * the caller-owned outputs (free them with freePipelineResult)
+ */
+bool runPipeline(Pipeline* pipeline, Image* image, PipelineResult* result);
+void freePipelineResult(PipelineResult* result);
+
+/*
+ * view helpers for runPipeline. viewRow returns the requested output row of the view,
+ * either pointing in to the source (no averaging) or computed in to the scratch row
+ * with the view's averaging mode.
+ * materializeView copies the view in to a new image and handleSavePngView encodes it
+ * row by row without materializing it
+ */
+void paveView(const PipelineView* view, int numOfImgs, int tile, PipelineView* tileView);
+byte* viewRow(Image* source, const PipelineView* view, size_t row, byte* scratch);
+bool materializeView(Image* source, const PipelineView* view, Image** image);
+bool handleSavePngView(Image* source, const PipelineView* view, Buffer* buf);
+
+/*
+ * number of channels of a color-type and the byte length of a row of the given width
+ */
+int colorTypeChannels(enum colorType colorTypeEnum);
+size_t imageRowBytes(const Image* image, size_t width);
+
+
+/*
+ * creates a result cache, memoryBudget and diskBudget are the total number of
+ * encoded bytes the cache may hold in memory and on disk (split across shards).
+ * diskDir is the directory used for spilled entries, a NULL diskDir or a zero
+ * diskBudget disables the disk tier. ret val is NULL in case of failure
+ */
+ImageCache* createImageCache(size_t memoryBudget, size_t diskBudget, const char* diskDir);
+
+/*
+ * frees every entry of the cache (including the spilled files) and the cache itself
+ */
+void freeImageCache(ImageCache* cache);
+
+/*
+ * cached equivalent of open -> average -> save. inBuffer/inSize is the encoded input
+ * in case of success retBuffer holds a copy of the encoded averaged image that is
+ * owned by the caller, either fetched from the cache or freshly computed and stored
+ */
+bool cachedAverageImage(ImageCache* cache, byte* inBuffer, size_t inSize, int avgDim,
+    const char* format, Buffer* retBuffer);
+
+/*
+ * same as cachedAverageImage, using the requested averaging mode (cachedAverageImage is
+ * AverageBox). the mode is part of the key, results of different modes never collide
+ */
+bool cachedAverageImageWithMode(ImageCache* cache, byte* inBuffer, size_t inSize, int avgDim,
+    enum averageMode mode, const char* format, Buffer* retBuffer);
+
+/*
+ * cached equivalent of open -> pave -> save for every chunk. in case of success
+ * retBuffers points to an allocated array of numOfImgs^2 encoded chunks that are
+ * owned by the caller (free each buffer's data and then the array itself)
+ */
+bool cachedPaveImage(ImageCache* cache, byte* inBuffer, size_t inSize, int numOfImgs,
+    const char* format, Buffer** retBuffers);
+
+/*
+ * 64-bit hash of the input buffer (xxHash64 layout), used for the cache keys
+ */
+uint64_t hashBuffer(const byte* buf, size_t size, uint64_t seed);
+uint64_t xxhRound(uint64_t acc, uint64_t lane);
+uint64_t xxhMergeRound(uint64_t acc, uint64_t lane);
+
+/*
+ * builds the key for the given input and operation, ret val is false if the save format is
+ * not supported. mode is the averaging mode of CacheAverage (AverageBox for CachePave).
+ * cacheKeySlot returns the shard index of the key and sets its bucket index
+ */
+bool makeCacheKey(const byte* inBuffer, size_t inSize, enum cacheOperation operation,
+    int param, enum averageMode mode, const char* format, CacheKey* key);
+size_t cacheKeySlot(const CacheKey* key, size_t* bucket);
+
+/*
+ * lookup returns a caller-owned copy of the cached outputs (spilled entries are read back
+ * from disk), insert stores a copy of the given outputs and evicts down to the budgets
+ */
+bool lookupImageCache(ImageCache* cache, const CacheKey* key, Buffer** outputs, int* numOfOutputs);
+void insertImageCache(ImageCache* cache, const CacheKey* key, const Buffer* outputs, int numOfOutputs);
+
+/*
+ * internal cache helpers, these expect the shard lock to be held by the caller
+ * evict detaches the entries over budget, queueing memory victims for spilling
+ * and the rest for destruction (linked through lruNext)
+ */
+CacheEntry* findCacheEntry(CacheShard* shard, const CacheKey* key, size_t bucket);
+void unlinkCacheLru(CacheEntry** head, CacheEntry** tail, CacheEntry* entry);
+void pushCacheLru(CacheEntry** head, CacheEntry** tail, CacheEntry* entry);
+void detachCacheEntry(CacheShard* shard, CacheEntry* entry);
+void queueCacheSpill(CacheShard* shard, CacheEntry* entry, CacheEntry** spills);
+void evictCacheShard(ImageCache* cache, CacheShard* shard, CacheEntry** spills, CacheEntry** drops);
+
+/*
+ * internal cache helpers that do the file I/O, called without the shard lock
+ * settle writes the queued spills and destroys the queued drops, taking the lock
+ * only for the bookkeeping after each written file
+ */
+void settleCacheShard(ImageCache* cache, CacheShard* shard, size_t shardIdx, CacheEntry* spills, CacheEntry* drops);
+void destroyCacheEntry(ImageCache* cache, size_t shardIdx, CacheEntry* entry);
+bool spillCacheEntry(ImageCache* cache, size_t shardIdx, CacheEntry* entry);
+bool loadCacheEntry(ImageCache* cache, size_t shardIdx, const CacheEntry* entry, Buffer** outputs);
+void cacheEntryPath(ImageCache* cache, size_t shardIdx, unsigned long fileId, char* path, size_t pathLen);
+bool sameCacheKey(const CacheKey* a, const CacheKey* b);
+void initCacheInstanceLock(void);
+
+/*
+ * creates an executor with numOfThreads workers, ret val is NULL in case of failure
+ * freeImageExecutor cancels the jobs that are still pending, waits for the workers to
+ * finish and frees the executor, the job handles stay valid and are freed by the caller
+ */
+ImageExecutor* createImageExecutor(int numOfThreads);
+void freeImageExecutor(ImageExecutor* executor);
+
+/*
+ * async variants of open/average/save, ret val is the queued job's handle or NULL in
+ * case of failure. callback and userData are optional, open decodes like
+ * openImageWithOptions (options is copied in to the job and may be NULL)
+ */
+ImageJob* openImageAsync(ImageExecutor* executor, byte* inBuffer, size_t inSize, const DecodeOptions* options,
+    enum jobPriority priority, JobCallback callback, void* userData);
+ImageJob* averageImageAsync(ImageExecutor* executor, int avgDim, Image* image, enum jobPriority priority,
+    JobCallback callback, void* userData);
+ImageJob* averageImageWithModeAsync(ImageExecutor* executor, int avgDim, enum averageMode mode, Image* image,
+    enum jobPriority priority, JobCallback callback, void* userData);
+ImageJob* saveImageAsync(ImageExecutor* executor, Image* image, const char* format, enum jobPriority priority,
+    JobCallback callback, void* userData);
+
+/*
+ * requests cancellation, a pending job is taken off the queue and finished right away
+ * and a running one stops at its next band. ret val is false if the job has already finished
+ */
+bool cancelImageJob(ImageJob* job);
+
+/*
+ * blocks until the job has finished, ret val is true if it completed successfully
+ */
+bool waitImageJob(ImageJob* job);
+
+/*
+ * frees a job handle, only after waitImageJob returned (the job's results are not freed)
+ */
+void freeImageJob(ImageJob* job);
+
+/*
+ * releases the handle without waiting, for callers that only use the callback (e.g. an
+ * event loop). the job frees itself once it has finished and its callback returned, so
+ * the callback has to take the results. the handle must not be used after this call
+ */
+void detachImageJob(ImageJob* job);
+
+/*
+ * internal executor helpers
+ */
+ImageJob* createImageJob(enum jobOperation operation, enum jobPriority priority,
+    JobCallback callback, void* userData);
+bool submitImageJob(ImageExecutor* executor, ImageJob* job);
+void runImageJob(ImageJob* job);
+void finishImageJob(ImageJob* job, bool success);
+void runExecutor(ImageExecutor* executor);
+bool isJobCancelled(ImageJob* job);
+
+/*
+ * helpers for the cache's deep copies of encoded outputs
+ */
+bool copyBuffers(const Buffer* src, int count, Buffer** dst);
+void freeBuffers(Buffer* buffers, int count);
+
+/*
+ * mutex wrappers over the portability layer
+ */
+void initMutex(Mutex* mutex);
+void lockMutex(Mutex* mutex);
+void unlockMutex(Mutex* mutex);
+void destroyMutex(Mutex* mutex);
+
+/*
+ * condition variable and thread wrappers over the portability layer
+ */
+void initCondition(Condition* condition);
+void waitCondition(Condition* condition, Mutex* mutex);
+void broadcastCondition(Condition* condition);
+void destroyCondition(Condition* condition);
+#ifdef _WIN32
+BOOL CALLBACK onceTrampoline(PINIT_ONCE once, PVOID init, PVOID* context);
+#endif
+void callOnce(Once* once, void (*init)(void));
+#ifdef _WIN32
+DWORD WINAPI workerThread(LPVOID arg);
+#else
+void* workerThread(void* arg);
+#endif
+bool startWorkerThread(Thread* thread, ImageExecutor* executor);
+void joinThread(Thread thread);
+
+/*
+ * seconds on a monotonic clock, only the difference between two calls is meaningful
+ */
+double monotonicSeconds(void);
+
+/*
+ * cpu seconds used by the calling process, only the difference between two calls is
+ * meaningful. unlike monotonicSeconds it doesn't count time other processes got the cpu
+ */
+double processCpuSeconds(void);
+
+/*
+ * id of the calling process, part of the cache's spill file names
+ */
+unsigned long currentProcessId(void);
+
+/*
+ * limits of the QA harnesses below main: the benchmark makes BENCH_PASSES passes over the
+ * corpus within BENCH_BUDGET_SECONDS of cpu time and fails when the corpus as a whole is
+ * more than BENCH_THRESHOLD_PERCENT slower than the baseline, the fuzz entry skips inputs
+ * declaring more than FUZZ_MAX_PIXELS pixels. on shared machines the speed of the same
+ * code drifts by tens of percent for tens of seconds at a time, the budget has to outlast
+ * that for the best pass of every file to be repeatable within the threshold
+ */
+#define BENCH_BUDGET_SECONDS 60.0
+#define BENCH_PASSES 20
+#define BENCH_THRESHOLD_PERCENT 20.0
+#define FUZZ_MAX_PIXELS (1 << 22)
+
+/*
+ * a corpus file of the benchmark, pixels is the size of the decoded input and bestSeconds
+ * the fastest pass per iteration so far
+ */
+typedef struct
+{
+    const char* name;
+    Buffer input;
+    double pixels;
+    double bestSeconds;
+} BenchFile;